@@ -9,22 +9,1110 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
+#include "../lib/connection.h"
+#include "../lib/pacer.h"
+#include "../lib/profile.h"
 #include "../lib/rdtp.h"
+#include "../lib/request.h"
+
+// FILES requests of a session in flight at once
+#define SESSION_PIPELINE 4
+
+// Most servers a download can be striped across
+#define MAX_SOURCES 16
+
+// A striped range is sized to take about this long at its server's rate
+#define STRIPE_SECONDS 0.25
+#define MIN_STRIPE (64 * 1024)
+#define MAX_STRIPE (8 * 1024 * 1024)
+
+// Failed ranges in a row before a server is given up on
+#define MAX_SOURCE_FAILURES 3
+
+/**
+ * One flow of a parallel download: fetches a byte range of the file over its
+ * own socket and writes it into the shared output file.
+ */
+typedef struct Flow {
+  pthread_t thread;
+  int fd;               // output file
+  const char *path;     // file on the server
+  size_t offset;
+  size_t length;
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  Config config;
+  bool ok;
+} Flow;
+
+/**
+ * Send a request and receive the answer as a byte array
+ */
+Buffer fetch(const Request *const request, int sockfd, struct sockaddr *addr,
+             socklen_t *addrLen, Config config)
+{
+  Buffer req = formatRequest(request);
+  Buffer answer = requestBytes(req, sockfd, addr, addrLen, config);
+  freeBuffer(&req);
+  return answer;
+}
+
+void *runFlow(void *arg)
+{
+  Flow *flow = (Flow *)arg;
+  flow->ok = false;
+
+  int sockfd = socket(flow->addr.ss_family, SOCK_DGRAM, 0);
+  if (sockfd == -1) {
+    perror("client: socket");
+    return NULL;
+  }
+
+  Request request;
+  request.type = REQUEST_RANGE;
+  strcpy(request.path, flow->path);
+  request.offset = flow->offset;
+  request.length = flow->length;
+
+  Buffer req = formatRequest(&request);
+  ssize_t received = requestToFile(req, flow->fd, flow->offset, sockfd,
+                                   (struct sockaddr *)&flow->addr,
+                                   &flow->addrLen, flow->config);
+  flow->ok = received == (ssize_t)flow->length;
+  freeBuffer(&req);
+
+  close(sockfd);
+  return NULL;
+}
+
+/**
+ * Ask a server for the size of a file, so that it can be split into ranges.
+ * Returns false if the server does not have the file.
+ */
+bool fetchSize(const char *path, int sockfd, const struct sockaddr *to,
+               socklen_t toLen, Config config, size_t *fileSize)
+{
+  Request request;
+  request.type = REQUEST_SIZE;
+  strcpy(request.path, path);
+
+  struct sockaddr_storage addr;
+  memcpy(&addr, to, toLen);
+  socklen_t addrLen = toLen;
+
+  Buffer sizeString = fetch(&request, sockfd, (struct sockaddr *)&addr,
+                            &addrLen, config);
+  if (sizeString.length == 0 || sizeString.length >= 32) {
+    printf("Unable to get size of %s.\n", path);
+    freeBuffer(&sizeString);
+    return false;
+  }
+  char temp[32];
+  memcpy(temp, sizeString.data, sizeString.length);
+  temp[sizeString.length] = '\0';
+  freeBuffer(&sizeString);
+  *fileSize = strtoull(temp, NULL, 10);
+  return true;
+}
+
+/**
+ * Create the output file at its full size, so that every range can be
+ * written in place.  Returns the file descriptor, or -1 on failure.
+ */
+int preallocate(const char *outPath, size_t fileSize)
+{
+  int fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    printf("Error: File %s cannot be written!\n", outPath);
+    return -1;
+  }
+  int rv = posix_fallocate(fd, 0, fileSize);
+  if (rv != 0 && ftruncate(fd, fileSize) == -1) {
+    printf("Error: Cannot allocate %zu bytes for %s\n", fileSize, outPath);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Download a file as numFlows byte ranges fetched concurrently, each over its
+ * own socket and thread.  Returns false if any range failed.
+ */
+bool parallelDownload(const char *path, const char *outPath, int numFlows,
+                      int sockfd, struct addrinfo *p, Config config)
+{
+  size_t fileSize;
+  if (!fetchSize(path, sockfd, p->ai_addr, p->ai_addrlen, config,
+                 &fileSize)) {
+    return false;
+  }
+
+  printf("File %s is %zu bytes, using %d flows\n", path, fileSize, numFlows);
+  if (fileSize == 0) {
+    printf("Received no bytes. Exiting.\n");
+    return false;
+  }
+  if ((size_t)numFlows > fileSize) {
+    numFlows = fileSize;
+  }
+
+  int fd = preallocate(outPath, fileSize);
+  if (fd == -1) {
+    return false;
+  }
+
+  Flow *flows = (Flow *)calloc(numFlows, sizeof(Flow));
+  size_t rangeLength = fileSize / numFlows;
+  for (int i = 0; i < numFlows; i++) {
+    flows[i].fd = fd;
+    flows[i].path = path;
+    flows[i].offset = i * rangeLength;
+    flows[i].length = (i < numFlows - 1) ? rangeLength
+                                          : fileSize - flows[i].offset;
+    memcpy(&flows[i].addr, p->ai_addr, p->ai_addrlen);
+    flows[i].addrLen = p->ai_addrlen;
+    flows[i].config = config;
+    if (pthread_create(&flows[i].thread, NULL, runFlow, &flows[i]) != 0) {
+      printf("Error: Cannot start flow %d\n", i);
+      exit(1);
+    }
+  }
+
+  bool ok = true;
+  for (int i = 0; i < numFlows; i++) {
+    pthread_join(flows[i].thread, NULL);
+    if (!flows[i].ok) {
+      printf("Error: Flow %d (%zu+%zu) failed\n", i, flows[i].offset,
+             flows[i].length);
+      ok = false;
+    }
+  }
+
+  free(flows);
+  close(fd);
+  return ok;
+}
+
+/**
+ * A byte range of a striped download
+ */
+typedef struct Range {
+  size_t offset;
+  size_t length;
+  size_t progress;      // bytes of the furthest attempt written so far
+  int owners;           // sources fetching it right now
+  bool done;
+  struct Range *next;   // in the retry list, or the list of all ranges
+  struct Range *all;
+} Range;
+
+/**
+ * State shared by the sources of a striped download.  Sources pull ranges
+ * as they finish the last one, so a fast source simply takes more of them.
+ */
+typedef struct Striper {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  const char *path;
+  int fd;
+  size_t fileSize;
+  size_t nextOffset;    // start of the part no range covers yet
+  size_t doneBytes;
+  Range *retry;         // ranges that failed, to be fetched again
+  Range *ranges;        // every range, for cleanup and the endgame
+  int liveSources;
+} Striper;
+
+typedef struct Source {
+  pthread_t thread;
+  char name[256];
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  Config config;
+  Striper *striper;
+  double rate;          // bytes/sec, smoothed over the ranges fetched
+  size_t bytes;         // bytes fetched
+  int failures;         // ranges failed in a row
+} Source;
+
+typedef struct RangeSink {
+  Striper *striper;
+  Range *range;
+  size_t length;
+} RangeSink;
+
+/**
+ * Sink that writes a range in place, and gives up once another source has
+ * finished the same range
+ */
+bool rangeSink(void *ctx, size_t offset, const uint8_t *data, size_t length)
+{
+  RangeSink *sink = (RangeSink *)ctx;
+  Range *range = sink->range;
+
+  pthread_mutex_lock(&sink->striper->lock);
+  bool done = range->done;
+  pthread_mutex_unlock(&sink->striper->lock);
+  if (done || range->length < offset + length) {
+    return false;
+  }
+
+  size_t written = 0;
+  while (written < length) {
+    ssize_t rv = pwrite(sink->striper->fd, data + written, length - written,
+                        range->offset + offset + written);
+    if (rv == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      printf("Error: Did not write out entire range!\n");
+      return false;
+    }
+    written += rv;
+  }
+  sink->length = offset + length;
+
+  pthread_mutex_lock(&sink->striper->lock);
+  if (range->progress < sink->length) {
+    range->progress = sink->length;
+  }
+  pthread_mutex_unlock(&sink->striper->lock);
+  return true;
+}
+
+/**
+ * Pick the next range for a source: a failed range first, then a new one
+ * sized to its rate, and at the end a duplicate of the range the others
+ * are furthest from finishing.  Called with the lock held.  Returns NULL if
+ * there is nothing to do right now.
+ */
+Range *takeRange(Striper *striper, const Source *source)
+{
+  if (striper->retry) {
+    Range *range = striper->retry;
+    striper->retry = range->next;
+    return range;
+  }
+
+  if (striper->nextOffset < striper->fileSize) {
+    size_t length = source->rate * STRIPE_SECONDS;
+    length = length < MIN_STRIPE ? MIN_STRIPE : length;
+    length = length > MAX_STRIPE ? MAX_STRIPE : length;
+    if (length > striper->fileSize - striper->nextOffset) {
+      length = striper->fileSize - striper->nextOffset;
+    }
+
+    Range *range = (Range *)calloc(1, sizeof(Range));
+    assert(range);
+    range->offset = striper->nextOffset;
+    range->length = length;
+    range->all = striper->ranges;
+    striper->ranges = range;
+    striper->nextOffset += length;
+    return range;
+  }
+
+  // Endgame: race the slowest range rather than sit idle
+  Range *slowest = NULL;
+  for (Range *range = striper->ranges; range; range = range->all) {
+    if (!range->done && range->owners == 1 &&
+        (!slowest || range->length - range->progress >
+                         slowest->length - slowest->progress)) {
+      slowest = range;
+    }
+  }
+  return slowest;
+}
+
+void *runSource(void *arg)
+{
+  Source *source = (Source *)arg;
+  Striper *striper = source->striper;
+
+  int sockfd = socket(source->addr.ss_family, SOCK_DGRAM, 0);
+  if (sockfd == -1) {
+    perror("client: socket");
+  }
+
+  pthread_mutex_lock(&striper->lock);
+  while (sockfd != -1 && striper->doneBytes < striper->fileSize) {
+    Range *range = takeRange(striper, source);
+    if (!range) {
+      pthread_cond_wait(&striper->changed, &striper->lock);
+      continue;
+    }
+    range->owners++;
+    pthread_mutex_unlock(&striper->lock);
+
+    Request request;
+    request.type = REQUEST_RANGE;
+    strcpy(request.path, striper->path);
+    request.offset = range->offset;
+    request.length = range->length;
+
+    RangeSink sink;
+    sink.striper = striper;
+    sink.range = range;
+    sink.length = 0;
+
+    struct sockaddr_storage addr = source->addr;
+    socklen_t addrLen = source->addrLen;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Buffer req = formatRequest(&request);
+    bool ok = CONNECTION_DONE == requestStream(req, sockfd,
+                                               (struct sockaddr *)&addr,
+                                               &addrLen, source->config,
+                                               rangeSink, &sink) &&
+              sink.length == range->length;
+    freeBuffer(&req);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    pthread_mutex_lock(&striper->lock);
+    range->owners--;
+    if (ok) {
+      source->failures = 0;
+      source->bytes += range->length;
+      double rate = range->length / (seconds > 1e-6 ? seconds : 1e-6);
+      source->rate = source->rate ? 0.5 * source->rate + 0.5 * rate : rate;
+      if (!range->done) {
+        range->done = true;
+        striper->doneBytes += range->length;
+      }
+    } else if (!range->done) {
+      printf("Error: %s failed range %zu+%zu\n", source->name, range->offset,
+             range->length);
+      if (!range->owners) {
+        range->progress = 0;
+        range->next = striper->retry;
+        striper->retry = range;
+      }
+      if (MAX_SOURCE_FAILURES <= ++source->failures) {
+        printf("Error: Giving up on %s\n", source->name);
+        pthread_cond_broadcast(&striper->changed);
+        break;
+      }
+    }
+    pthread_cond_broadcast(&striper->changed);
+  }
+
+  // Nobody is left to fetch what remains
+  if (0 == --striper->liveSources) {
+    pthread_cond_broadcast(&striper->changed);
+  }
+  pthread_mutex_unlock(&striper->lock);
+
+  if (sockfd != -1) {
+    close(sockfd);
+  }
+  return NULL;
+}
+
+/**
+ * Download a file striped across several servers holding the same files.
+ * Each server pulls ranges as it finishes the last one, sized to its
+ * observed rate, so faster servers take more of the file.  A server that
+ * keeps failing is dropped and its ranges go to the others, and at the end
+ * idle servers race the slowest range.  Returns false if the file could not
+ * be completed.
+ */
+bool stripedDownload(const char *path, const char *outPath, Source *sources,
+                     int numSources, int sockfd)
+{
+  size_t fileSize = 0;
+  bool sized = false;
+  for (int i = 0; !sized && i < numSources; i++) {
+    sized = fetchSize(path, sockfd, (struct sockaddr *)&sources[i].addr,
+                      sources[i].addrLen, sources[i].config, &fileSize);
+  }
+  if (!sized) {
+    return false;
+  }
+
+  printf("File %s is %zu bytes, striped across %d sources\n", path,
+         fileSize, numSources);
+  if (fileSize == 0) {
+    printf("Received no bytes. Exiting.\n");
+    return false;
+  }
+
+  Striper striper;
+  memset(&striper, 0, sizeof(striper));
+  pthread_mutex_init(&striper.lock, NULL);
+  pthread_cond_init(&striper.changed, NULL);
+  striper.path = path;
+  striper.fileSize = fileSize;
+  striper.fd = preallocate(outPath, fileSize);
+  if (striper.fd == -1) {
+    return false;
+  }
+
+  // Hold the lock so no source finishes before all are counted
+  pthread_mutex_lock(&striper.lock);
+  for (int i = 0; i < numSources; i++) {
+    sources[i].striper = &striper;
+    if (pthread_create(&sources[i].thread, NULL, runSource, &sources[i]) !=
+        0) {
+      printf("Error: Cannot start source %s\n", sources[i].name);
+      exit(1);
+    }
+    striper.liveSources++;
+  }
+  pthread_mutex_unlock(&striper.lock);
+
+  // Sources waiting for work give up once every live one is gone
+  pthread_mutex_lock(&striper.lock);
+  while (striper.liveSources && striper.doneBytes < fileSize) {
+    pthread_cond_wait(&striper.changed, &striper.lock);
+  }
+  bool ok = striper.doneBytes == fileSize;
+  striper.doneBytes = fileSize;
+  pthread_cond_broadcast(&striper.changed);
+  pthread_mutex_unlock(&striper.lock);
+
+  for (int i = 0; i < numSources; i++) {
+    pthread_join(sources[i].thread, NULL);
+    printf("%s: %zu bytes at %.1f KB/s\n", sources[i].name,
+           sources[i].bytes, sources[i].rate / 1024);
+  }
+
+  while (striper.ranges) {
+    Range *range = striper.ranges;
+    striper.ranges = range->all;
+    free(range);
+  }
+  pthread_mutex_destroy(&striper.lock);
+  pthread_cond_destroy(&striper.changed);
+  close(striper.fd);
+  return ok;
+}
+
+/**
+ * Resolve a "<host>:<port>" source.  Returns false if it cannot be.
+ */
+bool resolveSource(const char *hostPort, Source *source)
+{
+  snprintf(source->name, sizeof(source->name), "%s", hostPort);
+  char *colon = strrchr(source->name, ':');
+  if (!colon) {
+    fprintf(stderr, "Source %s is not <host>:<port>\n", hostPort);
+    return false;
+  }
+  *colon = '\0';
+
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  int rv = getaddrinfo(source->name, colon + 1, &hints, &info);
+  *colon = ':';
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return false;
+  }
+
+  memcpy(&source->addr, info->ai_addr, info->ai_addrlen);
+  source->addrLen = info->ai_addrlen;
+  freeaddrinfo(info);
+  return true;
+}
+
+/**
+ * Create the directories leading up to path
+ */
+bool makeParents(const char *path)
+{
+  char temp[2 * MAX_REQUEST_PATH];
+  strcpy(temp, path);
+  for (char *slash = strchr(temp + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(temp, 0755) == -1 && errno != EEXIST) {
+      printf("Error: Cannot create directory %s\n", temp);
+      return false;
+    }
+    *slash = '/';
+  }
+  return true;
+}
+
+/**
+ * One FILES request of a session, and how far its answer has come
+ */
+typedef struct Batch {
+  Connection *conn;
+  char **paths;
+  int numPaths;
+  int current;           // file whose frame is being received
+  uint8_t header[FRAME_HEADER_LENGTH];
+  size_t headerBytes;    // bytes of the current frame header received
+  uint64_t remaining;    // bytes of the current file still to come
+  FILE *out;
+  int missing;           // files the server could not send
+} Batch;
+
+/**
+ * Start writing the file whose frame header was just received
+ */
+bool startFrame(Batch *batch)
+{
+  FrameStatus status;
+  if (!parseFrameHeader(batch->header, &status, &batch->remaining)) {
+    printf("Error: Malformed frame for %s\n", batch->paths[batch->current]);
+    return false;
+  }
+
+  const char *path = batch->paths[batch->current];
+  if (status == FRAME_MISSING) {
+    printf("Error: Server cannot send %s\n", path);
+    batch->missing++;
+    return true;
+  }
+
+  char downloadedFileName[4096];
+  snprintf(downloadedFileName, sizeof(downloadedFileName), "DL_%s", path);
+  if (!makeParents(downloadedFileName)) {
+    return false;
+  }
+  batch->out = fopen(downloadedFileName, "w");
+  if (!batch->out) {
+    printf("Error: File %s cannot be written!\n", downloadedFileName);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Split the stream answering a FILES request into its files.  Returns false
+ * if the stream is malformed or a file cannot be written.
+ */
+bool receiveFrames(Batch *batch, const uint8_t *data, size_t length)
+{
+  while (length) {
+    if (batch->current == batch->numPaths) {
+      printf("Error: Server sent more files than asked for\n");
+      return false;
+    }
+
+    if (batch->headerBytes < FRAME_HEADER_LENGTH) {
+      size_t piece = FRAME_HEADER_LENGTH - batch->headerBytes;
+      piece = piece < length ? piece : length;
+      memcpy(batch->header + batch->headerBytes, data, piece);
+      batch->headerBytes += piece;
+      data += piece;
+      length -= piece;
+      if (batch->headerBytes < FRAME_HEADER_LENGTH) {
+        continue;
+      }
+      if (!startFrame(batch)) {
+        return false;
+      }
+    } else {
+      size_t piece = batch->remaining < length ? batch->remaining : length;
+      if (fwrite(data, 1, piece, batch->out) != piece) {
+        printf("Error: Did not write out entire file!\n");
+        return false;
+      }
+      batch->remaining -= piece;
+      data += piece;
+      length -= piece;
+    }
+
+    // Move on once the file is complete
+    if (batch->headerBytes == FRAME_HEADER_LENGTH && !batch->remaining) {
+      if (batch->out) {
+        fclose(batch->out);
+        batch->out = NULL;
+      }
+      batch->current++;
+      batch->headerBytes = 0;
+    }
+  }
+  return true;
+}
+
+/**
+ * Delete the first written files of a batch, after its stream failed its
+ * hash
+ */
+void discardFrames(Batch *batch, int written)
+{
+  for (int i = 0; i < written; i++) {
+    char downloadedFileName[4096];
+    snprintf(downloadedFileName, sizeof(downloadedFileName), "DL_%s",
+             batch->paths[i]);
+    if (0 == unlink(downloadedFileName)) {
+      printf("Error: Deleted %s, its stream failed the hash check\n",
+             downloadedFileName);
+    }
+  }
+}
+
+/**
+ * Download every file listed, one path per line, in listPath.  The paths are
+ * packed into as few FILES requests as fit in a packet each, and up to
+ * SESSION_PIPELINE of them are answered at once over the one socket, so the
+ * files stream back to back with no handshake in between.  Returns false if
+ * any file could not be downloaded.
+ */
+bool sessionDownload(const char *listPath, int sockfd, struct addrinfo *p,
+                     Config config)
+{
+  FILE *list = fopen(listPath, "r");
+  if (!list) {
+    printf("Error: File %s cannot be read!\n", listPath);
+    return false;
+  }
+
+  int numPaths = 0;
+  int capacity = 64;
+  char **paths = (char **)malloc(capacity * sizeof(char *));
+  char line[MAX_REQUEST_PATH];
+  while (fgets(line, sizeof(line), list)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!line[0]) {
+      continue;
+    }
+    if (numPaths == capacity) {
+      capacity *= 2;
+      paths = (char **)realloc(paths, capacity * sizeof(char *));
+    }
+    paths[numPaths++] = strdup(line);
+  }
+  fclose(list);
+
+  // Pack the paths into requests that each fit in a packet
+  const size_t maxRequest = MAX_PACKET_SIZE - PACKET_HEADER_LENGTH;
+  Batch *batches = (Batch *)calloc(numPaths ? numPaths : 1, sizeof(Batch));
+  int numBatches = 0;
+  size_t requestLength = maxRequest;
+  for (int i = 0; i < numPaths; i++) {
+    size_t pathLength = strlen(paths[i]) + 1;
+    if (maxRequest < strlen("FILES\n") + pathLength) {
+      printf("Error: Path %s is too long to request\n", paths[i]);
+      for (int j = 0; j < numPaths; j++) {
+        free(paths[j]);
+      }
+      free(paths);
+      free(batches);
+      return false;
+    }
+    if (maxRequest < requestLength + pathLength) {
+      batches[numBatches].paths = &paths[i];
+      numBatches++;
+      requestLength = strlen("FILES\n") - 1;
+    }
+    batches[numBatches - 1].numPaths++;
+    requestLength += pathLength;
+  }
+  printf("Asking for %d files in %d requests\n", numPaths, numBatches);
+
+  bool ok = true;
+  int started = 0;
+  int finished = 0;
+  Batch *active[SESSION_PIPELINE];
+  int numActive = 0;
+  uint8_t buffer[MAX_PACKET_SIZE];
+  uint8_t chunk[16 * 1024];
+
+  while (finished < numBatches) {
+    uint64_t now = monotonicNanos();
+
+    // Keep the pipeline full
+    while (numActive < SESSION_PIPELINE && started < numBatches) {
+      Batch *batch = &batches[started++];
+      Request request;
+      request.type = REQUEST_FILES;
+      request.path[0] = '\0';
+      for (int i = 0; i < batch->numPaths; i++) {
+        strcat(request.path, batch->paths[i]);
+        strcat(request.path, i + 1 < batch->numPaths ? "\n" : "");
+      }
+      Buffer req = formatRequest(&request);
+      batch->conn = makeClientConnection(req, config, now);
+      freeBuffer(&req);
+      active[numActive++] = batch;
+    }
+
+    // Send, take in the files received, and retire finished requests
+    uint64_t deadline = UINT64_MAX;
+    for (int i = 0; i < numActive; i++) {
+      Batch *batch = active[i];
+      Datagram datagram;
+      while (connectionOutput(batch->conn, now, &datagram)) {
+        sendDatagram(&datagram, sockfd, p->ai_addr, p->ai_addrlen);
+      }
+
+      size_t length;
+      bool valid = true;
+      while (valid &&
+             (length = connectionRead(batch->conn, chunk, sizeof(chunk)))) {
+        valid = receiveFrames(batch, chunk, length);
+      }
+
+      ConnectionState state = connectionState(batch->conn);
+      if (valid && state == CONNECTION_OPEN) {
+        uint64_t due = connectionDeadline(batch->conn);
+        deadline = due < deadline ? due : deadline;
+        continue;
+      }
+
+      // Files written so far, counting one cut short
+      int written = batch->current;
+      if (batch->out) {
+        fclose(batch->out);
+        batch->out = NULL;
+        written++;
+      }
+      if (state == CONNECTION_CORRUPTED) {
+        // Nothing the batch wrote can be trusted
+        discardFrames(batch, written);
+        ok = false;
+      } else if (!valid || state != CONNECTION_DONE ||
+                 batch->current != batch->numPaths || batch->missing) {
+        printf("Error: %d of %d files of a request were not received\n",
+               batch->numPaths - batch->current + batch->missing,
+               batch->numPaths);
+        ok = false;
+      }
+      freeConnection(batch->conn);
+      active[i--] = active[--numActive];
+      finished++;
+    }
+    if (!numActive) {
+      continue;
+    }
+
+    // Wait for a packet, or until the earliest timer is due
+    struct timeval tv;
+    uint64_t wait = deadline > now ? deadline - now : 0;
+    if (deadline == UINT64_MAX) {
+      wait = 1000000000ULL;
+    }
+    tv.tv_sec = wait / 1000000000ULL;
+    tv.tv_usec = (wait % 1000000000ULL) / 1000;
+
+    struct sockaddr_storage from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t bytesRec = receiveDatagram(sockfd, buffer,
+                                       (struct sockaddr *)&from, &fromLen,
+                                       config, tv);
+    now = monotonicNanos();
+
+    Packet rec;
+    if (0 < bytesRec && parseHeader(buffer, bytesRec, &rec) &&
+        sameAddress((struct sockaddr *)&from, p->ai_addr)) {
+      for (int i = 0; i < numActive; i++) {
+        if (connectionEpoch(active[i]->conn) == rec.epoch) {
+          connectionInput(active[i]->conn, buffer, bytesRec, now);
+        }
+      }
+    }
+
+    for (int i = 0; i < numActive; i++) {
+      if (connectionDeadline(active[i]->conn) <= now) {
+        connectionTick(active[i]->conn, now);
+      }
+    }
+  }
+
+  for (int i = 0; i < numPaths; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+  free(batches);
+  return ok;
+}
+
+/**
+ * How far unpacking the answer to an ARCHIVE request has come
+ */
+typedef struct Unpacker {
+  char root[MAX_REQUEST_PATH];  // directory the files are written under
+  uint8_t header[MAX_ENTRY_HEADER];
+  size_t headerBytes;           // bytes of the entry header received
+  size_t headerLength;          // 0 until the path length is in
+  bool inFile;                  // receiving the contents of an entry
+  uint64_t remaining;           // bytes of the entry still to come
+  FILE *out;
+  int files;
+  size_t received;              // bytes of the stream taken in so far
+  bool missing;                 // the server cannot find the directory
+  char **written;               // the files written so far
+  int capacity;
+} Unpacker;
+
+/**
+ * Start writing the entry whose header was just received
+ */
+bool startEntry(Unpacker *unpacker)
+{
+  char path[MAX_REQUEST_PATH];
+  if (!parseEntryHeader(unpacker->header, path, &unpacker->remaining)) {
+    printf("Error: Malformed archive entry\n");
+    return false;
+  }
+
+  char downloadedFileName[2 * MAX_REQUEST_PATH];
+  snprintf(downloadedFileName, sizeof(downloadedFileName), "%s/%s",
+           unpacker->root, path);
+  if (!makeParents(downloadedFileName)) {
+    return false;
+  }
+  unpacker->out = fopen(downloadedFileName, "w");
+  if (!unpacker->out) {
+    printf("Error: File %s cannot be written!\n", downloadedFileName);
+    return false;
+  }
+
+  if (unpacker->files == unpacker->capacity) {
+    unpacker->capacity = unpacker->capacity ? 2 * unpacker->capacity : 64;
+    unpacker->written = (char **)realloc(unpacker->written,
+                                         unpacker->capacity * sizeof(char *));
+    assert(unpacker->written);
+  }
+  unpacker->written[unpacker->files] = strdup(downloadedFileName);
+  assert(unpacker->written[unpacker->files]);
+
+  unpacker->inFile = true;
+  unpacker->headerBytes = 0;
+  unpacker->headerLength = 0;
+  unpacker->files++;
+  return true;
+}
+
+/**
+ * Delete the files an archive wrote, and the directories that leaves empty,
+ * after its stream failed its hash
+ */
+void discardEntries(Unpacker *unpacker)
+{
+  for (int i = 0; i < unpacker->files; i++) {
+    if (0 == unlink(unpacker->written[i])) {
+      printf("Error: Deleted %s, its stream failed the hash check\n",
+             unpacker->written[i]);
+    }
+  }
+
+  // Every file is gone, so the last walk up through a directory empties it
+  size_t rootLength = strlen(unpacker->root);
+  for (int i = 0; i < unpacker->files; i++) {
+    char *dir = unpacker->written[i];
+    char *slash;
+    while ((slash = strrchr(dir, '/')) && rootLength <= (size_t)(slash - dir)) {
+      *slash = '\0';
+      if (rmdir(dir) == -1) {
+        break;
+      }
+    }
+  }
+}
+
+/**
+ * Sink that unpacks an archive into files as it arrives
+ */
+bool unpackSink(void *ctx, size_t offset, const uint8_t *data, size_t length)
+{
+  Unpacker *unpacker = (Unpacker *)ctx;
+
+  // The entries only make sense if the stream arrives in order
+  if (offset != unpacker->received) {
+    printf("Error: Archive stream skipped from %zu to %zu\n",
+           unpacker->received, offset);
+    return false;
+  }
+  unpacker->received += length;
+
+  while (length || (unpacker->inFile && !unpacker->remaining)) {
+    if (unpacker->missing) {
+      printf("Error: Malformed archive entry\n");
+      return false;
+    }
+
+    if (unpacker->inFile) {
+      size_t piece = unpacker->remaining < length ? unpacker->remaining
+                                                  : length;
+      if (fwrite(data, 1, piece, unpacker->out) != piece) {
+        printf("Error: Did not write out entire file!\n");
+        return false;
+      }
+      unpacker->remaining -= piece;
+      data += piece;
+      length -= piece;
+
+      if (!unpacker->remaining) {
+        fclose(unpacker->out);
+        unpacker->out = NULL;
+        unpacker->inFile = false;
+      }
+      continue;
+    }
+
+    // The path length comes first, and gives the length of the rest
+    size_t need = unpacker->headerLength ? unpacker->headerLength : 2;
+    size_t piece = need - unpacker->headerBytes;
+    piece = piece < length ? piece : length;
+    memcpy(unpacker->header + unpacker->headerBytes, data, piece);
+    unpacker->headerBytes += piece;
+    data += piece;
+    length -= piece;
+
+    if (unpacker->headerBytes == need) {
+      if (!unpacker->headerLength) {
+        unpacker->headerLength = entryHeaderLength(unpacker->header);
+        if (!unpacker->headerLength && 0 == unpacker->files &&
+            0 == unpacker->header[0] && 0 == unpacker->header[1]) {
+          // Nothing but a zero path length says the directory is missing
+          unpacker->missing = true;
+          unpacker->headerBytes = 0;
+        } else if (!unpacker->headerLength) {
+          printf("Error: Malformed archive entry\n");
+          return false;
+        }
+      } else if (!startEntry(unpacker)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Download every file under a directory on the server as one archive
+ * stream, into DL_<dir>.  Returns false if the archive was cut short or the
+ * server cannot find the directory.
+ */
+bool archiveDownload(const char *dir, int sockfd, struct addrinfo *p,
+                     Config config)
+{
+  Request request;
+  request.type = REQUEST_ARCHIVE;
+  strcpy(request.path, dir);
+
+  Unpacker unpacker;
+  memset(&unpacker, 0, sizeof(unpacker));
+  snprintf(unpacker.root, sizeof(unpacker.root), "DL_%s", dir);
+  printf("Asking for directory %s\n", dir);
+
+  Buffer req = formatRequest(&request);
+  ConnectionState state = requestStream(req, sockfd, p->ai_addr,
+                                        &p->ai_addrlen, config, unpackSink,
+                                        &unpacker);
+  freeBuffer(&req);
+  bool ok = state == CONNECTION_DONE;
+
+  if (unpacker.out) {
+    fclose(unpacker.out);
+  }
+  if (state == CONNECTION_CORRUPTED) {
+    // Nothing the archive wrote can be trusted
+    discardEntries(&unpacker);
+  }
+  for (int i = 0; i < unpacker.files; i++) {
+    free(unpacker.written[i]);
+  }
+  free(unpacker.written);
+  if (unpacker.inFile || unpacker.headerBytes) {
+    printf("Error: Archive ended in the middle of an entry\n");
+    ok = false;
+  }
+  if (unpacker.missing) {
+    printf("Error: Directory %s cannot be found on the server\n", dir);
+    ok = false;
+  }
+
+  printf("Received %d files\n", unpacker.files);
+  return ok;
+}
+
+// Where to write the folded profile, if profiling
+static const char *profilePath = NULL;
+
+/**
+ * Report where the time went, however the client exits
+ */
+void reportProfile()
+{
+  profileReport(stderr);
+
+  FILE *folded = fopen(profilePath, "w");
+  if (!folded) {
+    printf("Error: File %s cannot be written!\n", profilePath);
+    return;
+  }
+  profileWriteFolded(folded, "client");
+  fclose(folded);
+}
 
 int main(int argc, char *argv[])
 {
   int sockfd;
   struct addrinfo hints, *servinfo, *p;
   int rv;
+  int numFlows = 1;
+  bool session = false;
+  bool archive = false;
+  char *mirrors = NULL;
 
   srand(time(NULL));
 
-  if (argc != 4 && argc != 7 && argc != 9) {
-    fprintf(stderr,"usage: client <hostname> <port> <filename> optional: <corruption> <packet loss> <CWnd> (<timeout_sec> <timeout_usec>)\n");
+  double pacingRate = 0.0;
+  bool txTime = false;
+  int dupAckThreshold = makeConfig().dupAckThreshold;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:p:Td:sam:P:")) != -1) {
+    switch (opt) {
+      case 'j':
+        numFlows = atoi(optarg);
+        break;
+      case 'p':
+        pacingRate = atof(optarg);
+        break;
+      case 'T':
+        txTime = true;
+        break;
+      case 'd':
+        dupAckThreshold = atoi(optarg);
+        break;
+      case 's':
+        session = true;
+        break;
+      case 'a':
+        archive = true;
+        break;
+      case 'm':
+        mirrors = optarg;
+        break;
+      case 'P':
+        profilePath = optarg;
+        break;
+      default:
+        numFlows = 0;
+        break;
+    }
+  }
+  // Leave the positional arguments where they have always been
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if ((argc != 4 && argc != 7 && argc != 9) || numFlows < 1) {
+    fprintf(stderr,"usage: client [-j <flows>] [-p <pacing bytes/sec>] [-T] [-d <dup ACKs>] [-s | -a | -m <host>:<port>[,...]] [-P <folded profile>] <hostname> <port> <filename or, with -s, file list or, with -a, directory> optional: <corruption> <packet loss> <CWnd> (<timeout_sec> <timeout_usec>)\n");
     exit(1);
   }
 
+  if (profilePath) {
+    profileEnable(true);
+    atexit(reportProfile);
+  }
+
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_DGRAM;
@@ -52,7 +1140,7 @@ int main(int argc, char *argv[])
     return 2;
   }
 
-  Config config;
+  Config config = makeConfig();
   if (argc == 7) {
     config.pC = atof(argv[4]);
     config.pL = atof(argv[5]);
@@ -83,30 +1171,81 @@ int main(int argc, char *argv[])
     config.timeout_sec = 0;
     config.timeout_usec = 5000;
   }
+  config.pacingRate = pacingRate;
+  config.txTime = txTime;
+  config.dupAckThreshold = dupAckThreshold;
+
+  char downloadedFileName[4096];
+  strcpy(downloadedFileName, "DL_");
+  strcat(downloadedFileName, argv[3]);
+
+  if (archive) {
+    bool ok = archiveDownload(argv[3], sockfd, p, config);
+    freeaddrinfo(servinfo);
+    close(sockfd);
+    return ok ? 0 : 1;
+  }
+
+  if (session) {
+    bool ok = sessionDownload(argv[3], sockfd, p, config);
+    freeaddrinfo(servinfo);
+    close(sockfd);
+    return ok ? 0 : 1;
+  }
+
+  if (mirrors) {
+    // The server given first is a source too
+    Source *sources = (Source *)calloc(MAX_SOURCES, sizeof(Source));
+    int numSources = 1;
+    snprintf(sources[0].name, sizeof(sources[0].name), "%s:%s", argv[1],
+             argv[2]);
+    memcpy(&sources[0].addr, p->ai_addr, p->ai_addrlen);
+    sources[0].addrLen = p->ai_addrlen;
+    for (char *save, *mirror = strtok_r(mirrors, ",", &save); mirror;
+         mirror = strtok_r(NULL, ",", &save)) {
+      if (numSources == MAX_SOURCES ||
+          !resolveSource(mirror, &sources[numSources])) {
+        exit(1);
+      }
+      numSources++;
+    }
+    for (int i = 0; i < numSources; i++) {
+      sources[i].config = config;
+    }
+
+    bool ok = stripedDownload(argv[3], downloadedFileName, sources,
+                              numSources, sockfd);
+    free(sources);
+    freeaddrinfo(servinfo);
+    close(sockfd);
+    return ok ? 0 : 1;
+  }
+
+  if (numFlows > 1) {
+    if (!parallelDownload(argv[3], downloadedFileName, numFlows, sockfd, p,
+                          config)) {
+      exit(1);
+    }
+
+    freeaddrinfo(servinfo);
+    close(sockfd);
+    return 0;
+  }
 
   Buffer buffer;
   buffer.data = (uint8_t*)argv[3];
   buffer.length = strlen(argv[3]);
-  bool asked = sendBytes(buffer, sockfd, p->ai_addr, p->ai_addrlen, config);
-  if(!asked) {
-    printf("Unable to reach server.\n");
-    exit(1);
-  }
-
-  printf("Asked for file %s\n", argv[3]);
+  printf("Asking for file %s\n", argv[3]);
 
   // Receive file back from server here
-  Buffer downloadedFile = receiveBytes(sockfd, p->ai_addr, &p->ai_addrlen, config);
+  Buffer downloadedFile = requestBytes(buffer, sockfd, p->ai_addr,
+                                       &p->ai_addrlen, config);
   if(downloadedFile.length == 0) {
     printf("Received no bytes. Exiting.\n");
     exit(1);
   }
   FILE *fp;
 
-  char downloadedFileName[4096];
-  strcpy(downloadedFileName, "DL_");
-  strcat(downloadedFileName, argv[3]);
-
   //printf("Name of file: %s", downloadedFileName);
 
   fp = fopen(downloadedFileName, "w");
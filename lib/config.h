@@ -0,0 +1,26 @@
+#ifndef LIB_CONFIG
+#define LIB_CONFIG
+
+#include <stdbool.h>
+
+/**
+ * Configuration struct for tweaking the parameters of RDTP
+ */
+typedef struct Config {
+  double pC;
+  double pL;
+  int windowSize;
+  int timeout_sec;
+  int timeout_usec;
+  double pacingRate;  // bytes/sec; 0 paces at windowSize per RTT, < 0 is off
+  bool txTime;        // pace with SO_TXTIME departure times where available
+  int dupAckThreshold;  // ACKs for later packets that mark a packet lost,
+                        // 0 waits for the timeout instead
+} Config;
+
+/**
+ * Config with the default parameters, for callers to adjust
+ */
+Config makeConfig();
+
+#endif  // LIB_CONFIG
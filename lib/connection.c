@@ -0,0 +1,821 @@
+#include "connection.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "pacer.h"
+#include "profile.h"
+#include "rdtp.h"
+
+// Keep the timeout as small as possible to increase transfer rate
+const int MAX_FIN_ATTEMPT = 50;
+
+// Number of times the receiver will receive TIMEDOUT before assuming
+// loss of connection.
+const int MAX_WAIT_ATTEMPTS = 500;
+const int MAX_SEND_ATTEMPTS = 500;
+
+// Pace at a bit above window / RTT so that pacing smooths the window out
+// without becoming the limit itself
+const double PACING_GAIN = 1.25;
+
+// Packets that may leave back to back before pacing kicks in
+const int PACING_BURST_PACKETS = 2;
+
+// Smallest receive buffer; it is also at least a few windows
+const size_t MIN_RECEIVE_BUFFER = 64 * 1024;
+
+// ACKs owed to the sender that have not been pulled yet
+#define ACK_QUEUE 512
+
+// Sender state for a packet in flight, kept in a window-sized slab
+typedef struct Slot {
+  Packet packet;       // payload and seq of the packet
+  size_t offset;       // offset of the payload in the stream
+  bool acked;
+  uint8_t header[16];  // serialized header, PACKET_HEADER_LENGTH bytes used
+  uint64_t sentAt;     // time of the last transmission
+  int sends;           // number of transmissions
+  int round;           // retransmission round of the last transmission
+  uint64_t order;      // position of the last transmission among all sends
+  int laterAcks;       // ACKs for packets sent after the last transmission
+} Slot;
+
+// Stream data queued for sending
+typedef struct Segment {
+  const Packet *packets;
+  int numPackets;
+  int next;                    // packets before next have entered the slab
+  uint64_t end;                // stream index of the packet after the last
+  Packet *ownedPackets;        // packet array to free, if we cut it
+  void (*release)(void *);
+  void *ctx;
+  struct Segment *nextSegment;
+} Segment;
+
+struct Connection {
+  bool isClient;
+  uint32_t epoch;
+  Config config;
+  int windowSize;
+  bool failed;
+  uint64_t lastHeard;  // time of the last packet or timer event
+  Hasher hash;         // of the stream bytes admitted (server) or read
+
+  // Scratch header and payload for control packets
+  uint8_t controlHeader[16];
+  uint8_t controlData[16];
+
+  // Client side
+  Packet request;      // REQ packet, owns its data
+  bool awaitingFirst;  // nothing of the answer has arrived yet
+  bool requestDue;
+  int timeOuts;
+  uint8_t *ring;       // receive buffer, indexed by stream offset % capacity
+  uint8_t *have;       // which ring bytes hold received data
+  size_t capacity;
+  size_t readOffset;   // next stream byte for connectionRead
+  size_t contiguous;   // first stream byte not yet received
+  uint32_t acks[ACK_QUEUE];
+  int ackHead;
+  int numAcks;
+  uint32_t lastSeq;    // seq of the last packet taken in
+  bool tookIn;         // lastSeq is set
+  size_t advertised;   // free space sent with the last ACK
+  bool finished;       // FIN received
+  bool hasExpected;    // the FIN carried the sender's stream hash
+  uint64_t expected;
+  bool mismatch;       // the stream read did not match it
+  bool finAckDue;
+
+  // Server side
+  Segment *segments;   // oldest first
+  Segment *lastSegment;
+  Segment *admitting;  // segment holding the next packet to enter the slab
+  uint64_t queued;     // packets queued on the stream so far
+  Slot *slab;
+  int slots;
+  uint64_t base;       // stream index of the first unacked packet
+  uint64_t admitted;   // stream index of the next packet to enter the slab
+  size_t admittedOffset;
+  bool finishing;      // connectionFinish was called
+  bool finDue;
+  int finAttempts;
+  bool finAcked;
+  int sendAttempts;
+  int round;
+  uint64_t sendOrder;
+  Pacer pacer;
+  uint64_t pacingAt;   // when the pacer lets the next packet go, 0 if now
+  double srtt;         // smoothed RTT, 0 until the first sample
+  size_t peerWindow;   // free space the receiver last advertised
+  bool peerWindowKnown;
+  bool probeDue;       // send a packet past a closed window
+};
+
+/**
+ * Pick a fresh, non-zero epoch for a new connection
+ */
+static uint32_t newEpoch() {
+  uint64_t seed = monotonicNanos() ^ ((uint64_t)getpid() << 32) ^ rand();
+  uint32_t epoch = (uint32_t)(seed ^ (seed >> 32)) * 2654435761u;
+  return epoch ? epoch : 1;
+}
+
+static uint64_t timeoutNanos(const Config *config) {
+  return (uint64_t)config->timeout_sec * 1000000000ULL +
+         (uint64_t)config->timeout_usec * 1000ULL;
+}
+
+int maxWindowSize() {
+  // Seq numbers must stay unambiguous across the window
+  return (MAX_SEQ_NUM + 1) / 2 - MAX_PACKET_SIZE;
+}
+
+/**
+ * Allocate a connection with the fields shared by both sides
+ */
+static Connection *makeConnection(bool isClient, uint32_t epoch,
+                                  Config config, uint64_t now) {
+  Connection *conn = (Connection *)calloc(1, sizeof(Connection));
+  assert(conn);
+  conn->isClient = isClient;
+  conn->epoch = epoch;
+  conn->config = config;
+  conn->lastHeard = now;
+  hashInit(&conn->hash, 0);
+
+  conn->windowSize = config.windowSize;
+  if (conn->windowSize > maxWindowSize()) {
+    conn->windowSize = maxWindowSize();
+  }
+  if (conn->windowSize < 0) {
+    conn->windowSize = 0;
+  }
+  return conn;
+}
+
+Connection *makeClientConnection(Buffer request, Config config,
+                                 uint64_t now) {
+  if (MAX_PACKET_SIZE - PACKET_HEADER_LENGTH < (int)request.length) {
+    return NULL;
+  }
+
+  Connection *conn = makeConnection(true, newEpoch(), config, now);
+  conn->request = makeReq(conn->epoch);
+  conn->request.data = (uint8_t *)malloc(request.length ? request.length : 1);
+  assert(conn->request.data);
+  memcpy(conn->request.data, request.data, request.length);
+  conn->request.length = request.length;
+  conn->awaitingFirst = true;
+  conn->requestDue = true;
+
+  conn->capacity = 4 * (size_t)conn->windowSize + MAX_PACKET_SIZE;
+  if (conn->capacity < MIN_RECEIVE_BUFFER) {
+    conn->capacity = MIN_RECEIVE_BUFFER;
+  }
+  conn->ring = (uint8_t *)malloc(conn->capacity);
+  conn->have = (uint8_t *)calloc(conn->capacity, 1);
+  assert(conn->ring && conn->have);
+  return conn;
+}
+
+Connection *makeServerConnection(uint32_t epoch, Config config,
+                                 uint64_t now) {
+  Connection *conn = makeConnection(false, epoch, config, now);
+
+  // Enough slots for a window of even very short packets
+  conn->slots = conn->windowSize / 16 + 8;
+  conn->slab = (Slot *)malloc(conn->slots * sizeof(Slot));
+  assert(conn->slab);
+  assert(PACKET_HEADER_LENGTH <= (int)sizeof(conn->slab[0].header));
+
+  pacerInit(&conn->pacer, config.pacingRate > 0 ? config.pacingRate : 0,
+            PACING_BURST_PACKETS * MAX_PACKET_SIZE, now);
+  return conn;
+}
+
+static void releaseSegment(Segment *segment) {
+  if (segment->release) {
+    segment->release(segment->ctx);
+  }
+  free(segment->ownedPackets);
+  free(segment);
+}
+
+void freeConnection(Connection *conn) {
+  if (!conn) {
+    return;
+  }
+
+  freePacket(&conn->request);
+  free(conn->ring);
+  free(conn->have);
+
+  while (conn->segments) {
+    Segment *segment = conn->segments;
+    conn->segments = segment->nextSegment;
+    releaseSegment(segment);
+  }
+  free(conn->slab);
+  free(conn);
+}
+
+uint32_t connectionEpoch(const Connection *conn) {
+  return conn->epoch;
+}
+
+ConnectionState connectionState(const Connection *conn) {
+  if (conn->failed) {
+    return CONNECTION_FAILED;
+  }
+
+  if (conn->isClient) {
+    if (conn->mismatch && !conn->finAckDue) {
+      return CONNECTION_CORRUPTED;
+    }
+    if (conn->finished && !conn->finAckDue &&
+        conn->readOffset == conn->contiguous) {
+      return CONNECTION_DONE;
+    }
+  } else if (conn->finAcked || MAX_FIN_ATTEMPT <= conn->finAttempts) {
+    return CONNECTION_DONE;
+  }
+
+  return CONNECTION_OPEN;
+}
+
+/**
+ * Point a datagram at a header and payload
+ */
+static void fillDatagram(Datagram *out, const uint8_t *header,
+                         const Packet *packet, uint64_t txTime) {
+  out->iov[0].iov_base = (void *)header;
+  out->iov[0].iov_len = PACKET_HEADER_LENGTH;
+  out->iov[1].iov_base = packet->data;
+  out->iov[1].iov_len = packet->length;
+  out->iovlen = packet->length ? 2 : 1;
+  out->txTime = txTime;
+}
+
+/**
+ * Fill a datagram with a control packet, serialized into the scratch header
+ */
+static void controlDatagram(Connection *conn, Packet packet, Datagram *out) {
+  packet.epoch = conn->epoch;
+  serializeHeader(&packet, conn->controlHeader);
+  fillDatagram(out, conn->controlHeader, &packet, 0);
+}
+
+/**
+ * Absolute stream offset of a seq number, taking the one closest to the
+ * first byte not received yet
+ */
+static ssize_t streamOffset(const Connection *conn, uint32_t seq) {
+  const ssize_t seqSpace = MAX_SEQ_NUM + 1;
+  ssize_t distance = ((ssize_t)seq - (ssize_t)(conn->contiguous % seqSpace) +
+                      seqSpace) % seqSpace;
+  if (seqSpace / 2 <= distance) {
+    distance -= seqSpace;
+  }
+  return (ssize_t)conn->contiguous + distance;
+}
+
+/**
+ * Bytes past the first missing one that the receive buffer has room for
+ */
+static size_t receiveWindow(const Connection *conn) {
+  size_t window = conn->readOffset + conn->capacity - conn->contiguous;
+  return window < UINT32_MAX ? window : UINT32_MAX;
+}
+
+static void queueAck(Connection *conn, uint32_t seq) {
+  // Drop the ACK if too many are owed; the sender will resend the packet
+  if (ACK_QUEUE <= conn->numAcks) {
+    return;
+  }
+  conn->acks[(conn->ackHead + conn->numAcks) % ACK_QUEUE] = seq;
+  conn->numAcks++;
+}
+
+/**
+ * Check the stream against the sender's hash, once all of it was read
+ */
+static void verifyStream(Connection *conn) {
+  if (conn->finished && conn->hasExpected &&
+      conn->readOffset == conn->contiguous) {
+    conn->mismatch = hashDigest(&conn->hash) != conn->expected;
+    conn->hasExpected = false;
+  }
+}
+
+static void clientInput(Connection *conn, const Packet *rec, uint64_t now) {
+  if (rec->isReq || rec->isAck) {
+    return;
+  }
+
+  conn->awaitingFirst = false;
+  conn->requestDue = false;
+  conn->timeOuts = 0;
+  conn->lastHeard = now;
+
+  if (rec->isFin) {
+    // Sender only sends FIN once every packet was acked
+    if (!conn->finished) {
+      conn->hasExpected = getFinHash(rec, &conn->expected);
+    }
+    conn->finished = true;
+    conn->finAckDue = true;
+    verifyStream(conn);
+    return;
+  }
+
+  ssize_t offset = streamOffset(conn, rec->seq);
+  if (offset < 0) {
+    return;
+  }
+  size_t end = offset + rec->length;
+
+  // No room to keep it; leave it unacked and the sender will resend it,
+  // but tell the sender how much room there is, so that it keeps probing
+  if (conn->readOffset + conn->capacity < end) {
+    if (conn->tookIn && !conn->numAcks) {
+      queueAck(conn, conn->lastSeq);
+    }
+    return;
+  }
+
+  // Copy in the bytes not received yet
+  for (size_t o = offset > (ssize_t)conn->contiguous ? (size_t)offset
+                                                     : conn->contiguous;
+       o < end; o++) {
+    size_t index = o % conn->capacity;
+    conn->ring[index] = rec->data[o - offset];
+    conn->have[index] = 1;
+  }
+  while (conn->contiguous < conn->readOffset + conn->capacity &&
+         conn->have[conn->contiguous % conn->capacity]) {
+    conn->contiguous++;
+  }
+
+  conn->lastSeq = rec->seq;
+  conn->tookIn = true;
+  queueAck(conn, rec->seq);
+}
+
+/**
+ * Tell the sender that the receive buffer has room again, if the last
+ * window advertised may be holding it back.  The ACK repeats the last seq
+ * taken in, which the sender already has.
+ */
+static void updateWindow(Connection *conn, size_t minGrowth) {
+  if (!conn->tookIn || conn->finished || conn->numAcks ||
+      (size_t)conn->windowSize + MAX_PACKET_SIZE <= conn->advertised ||
+      receiveWindow(conn) < conn->advertised + minGrowth) {
+    return;
+  }
+  queueAck(conn, conn->lastSeq);
+}
+
+/**
+ * Release the segments whose packets have all been acked
+ */
+static void releaseAcked(Connection *conn) {
+  while (conn->segments && conn->segments != conn->admitting &&
+         conn->segments->end <= conn->base) {
+    Segment *segment = conn->segments;
+    conn->segments = segment->nextSegment;
+    if (conn->lastSegment == segment) {
+      conn->lastSegment = NULL;
+    }
+    releaseSegment(segment);
+  }
+}
+
+static void serverInput(Connection *conn, const Packet *rec, uint64_t now) {
+  if (rec->isReq) {
+    // The client resending its request; the answer is on its way
+    return;
+  }
+
+  conn->lastHeard = now;
+
+  if (rec->isAck && rec->isFin) {
+    if (conn->finishing && conn->base == conn->queued) {
+      conn->finAcked = true;
+    }
+    return;
+  }
+  if (!rec->isAck) {
+    return;
+  }
+
+  uint32_t window;
+  if (getAckWindow(rec, &window)) {
+    conn->peerWindow = window;
+    conn->peerWindowKnown = true;
+
+    // The receiver is there, even if its window is closed
+    conn->sendAttempts = 0;
+  }
+
+  for (uint64_t i = conn->base; i < conn->admitted; i++) {
+    Slot *slot = &conn->slab[i % conn->slots];
+    if (slot->acked || rec->seq != slot->packet.seq) {
+      continue;
+    }
+
+    slot->acked = true;
+    conn->sendAttempts = 0;
+
+    // Fast retransmit: a packet that enough packets sent after it have
+    // overtaken is presumed lost, and goes out again without waiting for
+    // the round to time out
+    if (0 < conn->config.dupAckThreshold) {
+      for (uint64_t j = conn->base; j < conn->admitted; j++) {
+        Slot *earlier = &conn->slab[j % conn->slots];
+        if (earlier->acked || earlier->round != conn->round ||
+            earlier->order > slot->order) {
+          continue;
+        }
+        earlier->laterAcks++;
+        if (conn->config.dupAckThreshold <= earlier->laterAcks) {
+          earlier->round = -1;
+        }
+      }
+    }
+
+    // Sample the RTT from packets that were only sent once
+    if (1 == slot->sends && now > slot->sentAt) {
+      double sample = now - slot->sentAt;
+      conn->srtt = conn->srtt ? (7 * conn->srtt + sample) / 8 : sample;
+      if (0 == conn->config.pacingRate) {
+        pacerSetRate(&conn->pacer,
+                     PACING_GAIN * conn->windowSize * 1e9 / conn->srtt, now);
+      }
+    }
+    break;
+  }
+
+  // Move window up if need be
+  while (conn->base < conn->admitted &&
+         conn->slab[conn->base % conn->slots].acked) {
+    conn->base++;
+  }
+  releaseAcked(conn);
+}
+
+void connectionInput(Connection *conn, const uint8_t *datagram, size_t length,
+                     uint64_t now) {
+  Packet rec;
+  if (!parseHeader(datagram, length, &rec) || rec.epoch != conn->epoch ||
+      connectionState(conn) != CONNECTION_OPEN) {
+    return;
+  }
+
+  uint64_t started = profileStart();
+  if (conn->isClient) {
+    clientInput(conn, &rec, now);
+  } else {
+    serverInput(conn, &rec, now);
+  }
+  profileEnd(PHASE_INPUT, started);
+}
+
+/**
+ * Move queued packets into the slab while they fit in the window
+ */
+static void admit(Connection *conn) {
+  while (conn->admitting && conn->admitted - conn->base < (uint64_t)conn->slots) {
+    Segment *segment = conn->admitting;
+    if (segment->next == segment->numPackets) {
+      conn->admitting = segment->nextSegment;
+      continue;
+    }
+
+    // Only send packets in window size
+    size_t windowMin = conn->base < conn->admitted
+                           ? conn->slab[conn->base % conn->slots].offset
+                           : conn->admittedOffset;
+    if (windowMin + conn->windowSize < conn->admittedOffset) {
+      break;
+    }
+
+    // Nor more than the receiver has room for, except for one packet at a
+    // time to probe a closed window
+    bool probe = conn->probeDue && conn->base == conn->admitted;
+    if (conn->peerWindowKnown && !probe &&
+        windowMin + conn->peerWindow <
+            conn->admittedOffset + segment->packets[segment->next].length) {
+      break;
+    }
+    conn->probeDue = false;
+
+    Slot *slot = &conn->slab[conn->admitted % conn->slots];
+    slot->packet = segment->packets[segment->next];
+    slot->packet.seq = conn->admittedOffset % (MAX_SEQ_NUM + 1);
+    slot->packet.epoch = conn->epoch;
+    slot->offset = conn->admittedOffset;
+    hashUpdate(&conn->hash, slot->packet.data, slot->packet.length);
+    slot->acked = 0 == slot->packet.length;
+    slot->sends = 0;
+    slot->round = -1;
+    slot->laterAcks = 0;
+    assert(slot->packet.length + PACKET_HEADER_LENGTH <=
+           (size_t)MAX_PACKET_SIZE);
+    serializeHeader(&slot->packet, slot->header);
+
+    segment->next++;
+    conn->admittedOffset += slot->packet.length;
+    conn->admitted++;
+  }
+
+  // Skip over empty packets
+  while (conn->base < conn->admitted &&
+         conn->slab[conn->base % conn->slots].acked) {
+    conn->base++;
+  }
+  releaseAcked(conn);
+}
+
+static bool clientOutput(Connection *conn, Datagram *out) {
+  if (conn->requestDue) {
+    conn->requestDue = false;
+    serializeHeader(&conn->request, conn->controlHeader);
+    fillDatagram(out, conn->controlHeader, &conn->request, 0);
+    return true;
+  }
+
+  if (conn->numAcks) {
+    uint32_t seq = conn->acks[conn->ackHead];
+    conn->ackHead = (conn->ackHead + 1) % ACK_QUEUE;
+    conn->numAcks--;
+    Packet ack = makeAck(seq);
+    conn->advertised = receiveWindow(conn);
+    setAckWindow(&ack, conn->controlData, conn->advertised);
+    controlDatagram(conn, ack, out);
+    return true;
+  }
+
+  if (conn->finAckDue) {
+    conn->finAckDue = false;
+    controlDatagram(conn, makeFinAck(), out);
+    return true;
+  }
+
+  return false;
+}
+
+static bool serverOutput(Connection *conn, uint64_t now, Datagram *out) {
+  admit(conn);
+
+  bool wasIdle = true;
+  for (uint64_t i = conn->base; i < conn->admitted; i++) {
+    Slot *slot = &conn->slab[i % conn->slots];
+    if (slot->sends) {
+      wasIdle = false;
+    }
+
+    // Send if unacked and not yet sent this round
+    if (slot->acked || slot->round == conn->round) {
+      continue;
+    }
+
+    size_t bytes = slot->packet.length + PACKET_HEADER_LENGTH;
+    if (!conn->config.txTime) {
+      uint64_t wait = pacerDelay(&conn->pacer, bytes, now);
+      if (wait) {
+        conn->pacingAt = now + wait;
+        return false;
+      }
+    }
+    uint64_t departure = pacerSchedule(&conn->pacer, bytes, now);
+    conn->pacingAt = 0;
+
+    fillDatagram(out, slot->header, &slot->packet,
+                 conn->config.txTime ? departure : 0);
+    slot->sentAt = departure;
+    slot->sends++;
+    slot->round = conn->round;
+    slot->order = conn->sendOrder++;
+    slot->laterAcks = 0;
+
+    // The retransmission timer runs from when the link got busy
+    if (wasIdle) {
+      conn->lastHeard = now;
+    }
+    return true;
+  }
+
+  // Send FIN once everything queued was acked
+  if (conn->finishing && conn->base == conn->queued && conn->finDue) {
+    conn->finDue = false;
+    conn->finAttempts++;
+    conn->lastHeard = now;
+    Packet fin = makeFin();
+    setFinHash(&fin, conn->controlData, hashDigest(&conn->hash));
+    controlDatagram(conn, fin, out);
+    return true;
+  }
+
+  return false;
+}
+
+bool connectionOutput(Connection *conn, uint64_t now, Datagram *out) {
+  if (conn->failed) {
+    return false;
+  }
+  uint64_t started = profileStart();
+  bool produced = conn->isClient ? clientOutput(conn, out)
+                                 : serverOutput(conn, now, out);
+  profileEnd(PHASE_OUTPUT, started);
+  return produced;
+}
+
+/**
+ * Whether the server is waiting on the peer for anything, including for its
+ * window to open
+ */
+static bool serverBusy(const Connection *conn) {
+  if (conn->base < conn->queued) {
+    return true;
+  }
+  return conn->finishing && conn->base == conn->queued && !conn->finAcked;
+}
+
+uint64_t connectionDeadline(const Connection *conn) {
+  if (connectionState(conn) != CONNECTION_OPEN) {
+    return UINT64_MAX;
+  }
+
+  uint64_t deadline = conn->lastHeard + timeoutNanos(&conn->config);
+  if (!conn->isClient) {
+    if (!serverBusy(conn)) {
+      deadline = UINT64_MAX;
+    }
+    if (conn->pacingAt && conn->pacingAt < deadline) {
+      deadline = conn->pacingAt;
+    }
+  }
+  return deadline;
+}
+
+static void tick(Connection *conn, uint64_t now) {
+  if (connectionState(conn) != CONNECTION_OPEN) {
+    return;
+  }
+
+  if (conn->pacingAt && conn->pacingAt <= now) {
+    conn->pacingAt = 0;
+  }
+
+  if (now < conn->lastHeard + timeoutNanos(&conn->config)) {
+    return;
+  }
+
+  if (conn->isClient) {
+    // Handle loss of connection
+    conn->timeOuts++;
+    if (MAX_WAIT_ATTEMPTS < conn->timeOuts) {
+      conn->failed = true;
+    }
+
+    // The request or the start of the answer was lost
+    if (conn->awaitingFirst) {
+      conn->requestDue = true;
+    }
+
+    // A window update may have been lost
+    updateWindow(conn, 1);
+  } else if (serverBusy(conn)) {
+    if (conn->base < conn->queued) {
+      // Everything left in the window is presumed lost.  With nothing in
+      // flight, the receiver's window is closed, and the next packet goes
+      // out anyway to probe it.
+      conn->round++;
+      conn->probeDue = conn->base == conn->admitted;
+      conn->sendAttempts++;
+
+      // If nobody is listening, let the sender timeout
+      if (MAX_SEND_ATTEMPTS < conn->sendAttempts) {
+        conn->failed = true;
+      }
+    } else {
+      conn->finDue = true;
+    }
+  }
+
+  conn->lastHeard = now;
+}
+
+void connectionTick(Connection *conn, uint64_t now) {
+  uint64_t started = profileStart();
+  tick(conn, now);
+  profileEnd(PHASE_TIMERS, started);
+}
+
+static size_t readStream(Connection *conn, uint8_t *buf, size_t length) {
+  size_t available = conn->contiguous - conn->readOffset;
+  if (length > available) {
+    length = available;
+  }
+
+  // Copy out of the ring in at most two pieces
+  size_t done = 0;
+  while (done < length) {
+    size_t index = (conn->readOffset + done) % conn->capacity;
+    size_t piece = conn->capacity - index;
+    if (piece > length - done) {
+      piece = length - done;
+    }
+    memcpy(buf + done, &conn->ring[index], piece);
+    hashUpdate(&conn->hash, buf + done, piece);
+    memset(&conn->have[index], 0, piece);
+    done += piece;
+  }
+  conn->readOffset += length;
+
+  // Bytes past the old end of the ring may already be in
+  while (conn->contiguous < conn->readOffset + conn->capacity &&
+         conn->have[conn->contiguous % conn->capacity]) {
+    conn->contiguous++;
+  }
+
+  if (length) {
+    updateWindow(conn, MAX_PACKET_SIZE);
+    verifyStream(conn);
+  }
+  return length;
+}
+
+size_t connectionRead(Connection *conn, uint8_t *buf, size_t length) {
+  uint64_t started = profileStart();
+  length = readStream(conn, buf, length);
+  profileEnd(PHASE_READ, started);
+  return length;
+}
+
+/**
+ * Add a segment to the end of the stream
+ */
+static void queueSegment(Connection *conn, const Packet *packets,
+                         int numPackets, Packet *ownedPackets,
+                         void (*release)(void *), void *ctx) {
+  assert(!conn->finishing);
+
+  Segment *segment = (Segment *)calloc(1, sizeof(Segment));
+  assert(segment);
+  segment->packets = packets;
+  segment->numPackets = numPackets;
+  segment->ownedPackets = ownedPackets;
+  segment->release = release;
+  segment->ctx = ctx;
+  conn->queued += numPackets;
+  segment->end = conn->queued;
+
+  if (conn->lastSegment) {
+    conn->lastSegment->nextSegment = segment;
+  } else {
+    conn->segments = segment;
+  }
+  conn->lastSegment = segment;
+  if (!conn->admitting) {
+    conn->admitting = segment;
+  }
+}
+
+void connectionSendPackets(Connection *conn, const Packet *packets,
+                           int numPackets, void (*release)(void *),
+                           void *ctx) {
+  queueSegment(conn, packets, numPackets, NULL, release, ctx);
+}
+
+void connectionSendBuffer(Connection *conn, const uint8_t *data,
+                          size_t length, void (*release)(void *), void *ctx) {
+  Buffer buf;
+  buf.data = (uint8_t *)data;
+  buf.length = length;
+
+  Packet *packets;
+  int numPackets = packetize(buf, &packets);
+  queueSegment(conn, packets, numPackets, packets, release, ctx);
+}
+
+void connectionWrite(Connection *conn, const uint8_t *data, size_t length) {
+  uint8_t *copy = (uint8_t *)malloc(length ? length : 1);
+  assert(copy);
+  memcpy(copy, data, length);
+  connectionSendBuffer(conn, copy, length, free, copy);
+}
+
+uint64_t connectionBacklog(const Connection *conn) {
+  return conn->queued - conn->admitted;
+}
+
+void connectionFinish(Connection *conn) {
+  conn->finishing = true;
+  conn->finDue = true;
+}
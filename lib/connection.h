@@ -0,0 +1,135 @@
+#ifndef LIB_CONNECTION
+#define LIB_CONNECTION
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "buffer.h"
+#include "config.h"
+#include "packet.h"
+
+/**
+ * Non-blocking RDTP connection.  A Connection is only a state machine: it
+ * never touches a socket or a clock.  The application feeds it the datagrams
+ * that arrive, pulls the datagrams it wants sent, calls it back when its
+ * timer deadline passes, and reads or writes stream bytes.  That lets any
+ * event loop drive as many transfers as it likes from one thread; the
+ * blocking functions in rdtp.h are written on top of it.
+ *
+ * All times are in nanoseconds on any monotonic clock the caller picks.
+ *
+ * A client connection sends a request and receives the stream answering it.
+ * A server connection is created for a received request and sends a stream.
+ */
+
+typedef struct Connection Connection;
+
+typedef enum {
+  CONNECTION_OPEN,       // still transferring
+  CONNECTION_DONE,       // stream delivered (or sent and FIN'd)
+  CONNECTION_FAILED,     // the peer stopped answering
+  CONNECTION_CORRUPTED   // the stream did not match the hash in the FIN
+} ConnectionState;
+
+/**
+ * One datagram to send: a header and a payload to be gathered together.
+ * The memory belongs to the connection and is valid until the next call
+ * into it.
+ */
+typedef struct Datagram {
+  struct iovec iov[2];
+  int iovlen;
+  uint64_t txTime;  // departure time for SO_TXTIME, 0 to send now
+} Datagram;
+
+/**
+ * Create a client connection asking for request, which must fit in one
+ * packet.  Returns NULL if it does not.
+ */
+Connection *makeClientConnection(Buffer request, Config config, uint64_t now);
+
+/**
+ * Create a server connection answering the request with the given epoch
+ */
+Connection *makeServerConnection(uint32_t epoch, Config config, uint64_t now);
+
+/**
+ * Largest window a connection uses.  Larger windows in the config are cut
+ * down to it, so that seq numbers stay unambiguous.
+ */
+int maxWindowSize();
+
+/**
+ * Free a connection, releasing any stream data still queued on it
+ */
+void freeConnection(Connection *conn);
+
+uint32_t connectionEpoch(const Connection *conn);
+
+ConnectionState connectionState(const Connection *conn);
+
+/**
+ * Feed a received datagram to the connection.  Datagrams of other
+ * connections are ignored.
+ */
+void connectionInput(Connection *conn, const uint8_t *datagram, size_t length,
+                     uint64_t now);
+
+/**
+ * Pull the next datagram to send.  Returns false if there is nothing to
+ * send now; the deadline says when to ask again.
+ */
+bool connectionOutput(Connection *conn, uint64_t now, Datagram *out);
+
+/**
+ * Time of the connection's next timer event, UINT64_MAX if there is none
+ */
+uint64_t connectionDeadline(const Connection *conn);
+
+/**
+ * Run the timer events due by now
+ */
+void connectionTick(Connection *conn, uint64_t now);
+
+/**
+ * Read in-order stream bytes received so far (client).  Returns the number
+ * of bytes read.
+ */
+size_t connectionRead(Connection *conn, uint8_t *buf, size_t length);
+
+/**
+ * Queue packets, as cut by packetize, at the end of the stream (server).
+ * The packets and the data they point to are only read, and must stay alive
+ * until release(ctx) is called; release may be NULL.
+ */
+void connectionSendPackets(Connection *conn, const Packet *packets,
+                           int numPackets, void (*release)(void *),
+                           void *ctx);
+
+/**
+ * Queue length bytes of data at the end of the stream (server).  The data
+ * must stay alive until release(ctx) is called; release may be NULL.
+ */
+void connectionSendBuffer(Connection *conn, const uint8_t *data,
+                          size_t length, void (*release)(void *), void *ctx);
+
+/**
+ * Queue a copy of data at the end of the stream (server)
+ */
+void connectionWrite(Connection *conn, const uint8_t *data, size_t length);
+
+/**
+ * Number of queued packets that have not entered the window yet (server).
+ * Lets the application produce the stream as it is sent, rather than queue
+ * all of it up front.
+ */
+uint64_t connectionBacklog(const Connection *conn);
+
+/**
+ * Mark the end of the stream (server).  The FIN goes out once everything
+ * queued has been acked.
+ */
+void connectionFinish(Connection *conn);
+
+#endif  // LIB_CONNECTION
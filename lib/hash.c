@@ -0,0 +1,135 @@
+#include "hash.h"
+
+#include <string.h>
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Input words are little-endian whatever the host
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t round64(uint64_t lane, uint64_t input) {
+  lane += input * PRIME2;
+  lane = rotl(lane, 31);
+  return lane * PRIME1;
+}
+
+static inline uint64_t merge(uint64_t acc, uint64_t lane) {
+  acc ^= round64(0, lane);
+  return acc * PRIME1 + PRIME4;
+}
+
+/**
+ * Hash whole stripes.  The four lanes do not depend on each other.
+ */
+static const uint8_t *hashStripes(uint64_t *lanes, const uint8_t *p,
+                                  const uint8_t *end) {
+  uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+  while (p + 32 <= end) {
+    v1 = round64(v1, read64(p));
+    v2 = round64(v2, read64(p + 8));
+    v3 = round64(v3, read64(p + 16));
+    v4 = round64(v4, read64(p + 24));
+    p += 32;
+  }
+  lanes[0] = v1;
+  lanes[1] = v2;
+  lanes[2] = v3;
+  lanes[3] = v4;
+  return p;
+}
+
+void hashInit(Hasher *hasher, uint64_t seed) {
+  memset(hasher, 0, sizeof(Hasher));
+  hasher->seed = seed;
+  hasher->lanes[0] = seed + PRIME1 + PRIME2;
+  hasher->lanes[1] = seed + PRIME2;
+  hasher->lanes[2] = seed;
+  hasher->lanes[3] = seed - PRIME1;
+}
+
+void hashUpdate(Hasher *hasher, const uint8_t *data, size_t length) {
+  const uint8_t *end = data + length;
+  hasher->total += length;
+
+  // Finish the stripe left over from last time
+  if (hasher->buffered) {
+    size_t piece = 32 - hasher->buffered;
+    if (piece > length) {
+      piece = length;
+    }
+    memcpy(hasher->stripe + hasher->buffered, data, piece);
+    hasher->buffered += piece;
+    data += piece;
+    if (hasher->buffered < 32) {
+      return;
+    }
+    hashStripes(hasher->lanes, hasher->stripe, hasher->stripe + 32);
+    hasher->buffered = 0;
+  }
+
+  data = hashStripes(hasher->lanes, data, end);
+
+  memcpy(hasher->stripe, data, end - data);
+  hasher->buffered = end - data;
+}
+
+uint64_t hashDigest(const Hasher *hasher) {
+  uint64_t h;
+  if (hasher->total >= 32) {
+    const uint64_t *v = hasher->lanes;
+    h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    h = merge(h, v[0]);
+    h = merge(h, v[1]);
+    h = merge(h, v[2]);
+    h = merge(h, v[3]);
+  } else {
+    h = hasher->seed + PRIME5;
+  }
+  h += hasher->total;
+
+  // Fold in the tail
+  const uint8_t *p = hasher->stripe;
+  const uint8_t *end = p + hasher->buffered;
+  while (p + 8 <= end) {
+    h ^= round64(0, read64(p));
+    h = rotl(h, 27) * PRIME1 + PRIME4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME1;
+    h = rotl(h, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * PRIME5;
+    h = rotl(h, 11) * PRIME1;
+    p++;
+  }
+
+  // Avalanche
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+  return h;
+}
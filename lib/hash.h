@@ -0,0 +1,30 @@
+#ifndef LIB_HASH
+#define LIB_HASH
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Incremental 64-bit content hash, compatible with XXH64.  Input is taken
+ * in 32-byte stripes over four independent lanes, so the compiler can keep
+ * them all in flight at once.  Feeding the data in any number of pieces
+ * gives the same digest as feeding it whole.
+ */
+typedef struct Hasher {
+  uint64_t lanes[4];
+  uint64_t seed;
+  uint64_t total;      // bytes fed so far
+  uint8_t stripe[32];  // partial stripe not hashed yet
+  size_t buffered;
+} Hasher;
+
+void hashInit(Hasher *hasher, uint64_t seed);
+
+void hashUpdate(Hasher *hasher, const uint8_t *data, size_t length);
+
+/**
+ * Digest of everything fed so far.  The hasher can keep being fed after.
+ */
+uint64_t hashDigest(const Hasher *hasher);
+
+#endif  // LIB_HASH
@@ -0,0 +1,66 @@
+#include "pacer.h"
+
+#include <time.h>
+
+const double NANOS_PER_SEC = 1e9;
+
+/**
+ * Current time from the monotonic clock, in nanoseconds
+ */
+uint64_t monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Add the tokens earned since the last refill
+ */
+static void refill(Pacer *pacer, uint64_t now) {
+  if (now > pacer->last) {
+    pacer->tokens += (now - pacer->last) * pacer->rate / NANOS_PER_SEC;
+    if (pacer->tokens > pacer->burst) {
+      pacer->tokens = pacer->burst;
+    }
+  }
+  pacer->last = now;
+}
+
+void pacerInit(Pacer *pacer, double rate, double burst, uint64_t now) {
+  pacer->rate = rate;
+  pacer->tokens = burst;
+  pacer->burst = burst;
+  pacer->last = now;
+}
+
+void pacerSetRate(Pacer *pacer, double rate, uint64_t now) {
+  refill(pacer, now);
+  pacer->rate = rate;
+}
+
+uint64_t pacerDelay(Pacer *pacer, size_t bytes, uint64_t now) {
+  if (0 == pacer->rate) {
+    return 0;
+  }
+
+  refill(pacer, now);
+  if (pacer->tokens >= bytes) {
+    return 0;
+  }
+
+  return (uint64_t)((bytes - pacer->tokens) * NANOS_PER_SEC / pacer->rate) + 1;
+}
+
+uint64_t pacerSchedule(Pacer *pacer, size_t bytes, uint64_t now) {
+  if (0 == pacer->rate) {
+    return now;
+  }
+
+  refill(pacer, now);
+  pacer->tokens -= bytes;
+  if (pacer->tokens >= 0) {
+    return now;
+  }
+
+  return now + (uint64_t)(-pacer->tokens * NANOS_PER_SEC / pacer->rate);
+}
@@ -0,0 +1,40 @@
+#ifndef LIB_PACER
+#define LIB_PACER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Token bucket that spreads transmissions out at a given rate, instead of
+ * letting a whole window leave back to back.  Tokens are bytes, and time is
+ * kept in nanoseconds so rates well above one packet per millisecond work.
+ */
+typedef struct Pacer {
+  double rate;     // bytes per second, 0 means unpaced
+  double tokens;   // bytes that may be sent now, negative when scheduled ahead
+  double burst;    // most tokens that can build up while idle
+  uint64_t last;   // time of the last refill
+} Pacer;
+
+/**
+ * Current time from the monotonic clock, in nanoseconds
+ */
+uint64_t monotonicNanos();
+
+void pacerInit(Pacer *pacer, double rate, double burst, uint64_t now);
+
+void pacerSetRate(Pacer *pacer, double rate, uint64_t now);
+
+/**
+ * Nanoseconds until bytes may be sent, 0 if they may be sent now
+ */
+uint64_t pacerDelay(Pacer *pacer, size_t bytes, uint64_t now);
+
+/**
+ * Take bytes from the bucket, and return when they are due to leave.  The
+ * bucket may go into debt, which schedules the bytes in the future; that is
+ * how departure times are handed to the kernel with SO_TXTIME.
+ */
+uint64_t pacerSchedule(Pacer *pacer, size_t bytes, uint64_t now);
+
+#endif  // LIB_PACER
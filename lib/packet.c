@@ -6,18 +6,23 @@
  */
 
 const int MAX_PACKET_SIZE = 1000;    // number of bytes
-const int PACKET_HEADER_LENGTH = 5;  // number of bytes
+const int PACKET_HEADER_LENGTH = 9;  // number of bytes
 const int MAX_SEQ_NUM = 30000;  // 30,000 is the max seq num allowed
+const int ACK_WINDOW_LENGTH = 4;  // number of bytes
+const int FIN_HASH_LENGTH = 8;  // number of bytes
 
 const int FLAG_ACK = 1 << 7;
 const int FLAG_FIN = 1 << 6;
+const int FLAG_REQ = 1 << 5;
 
 // Caller must set data and length fields
 Packet makeTrn(uint32_t seq) {
   Packet p;
   p.isAck = false;
   p.isFin = false;
+  p.isReq = false;
   p.seq = seq;
+  p.epoch = 0;
   p.data = NULL;
   p.length = 0;
   return p;
@@ -27,7 +32,9 @@ Packet makeAck(uint32_t seq) {
   Packet p;
   p.isAck = true;
   p.isFin = false;
+  p.isReq = false;
   p.seq = seq;
+  p.epoch = 0;
   p.data = NULL;
   p.length = 0;
   return p;
@@ -37,7 +44,9 @@ Packet makeFin() {
   Packet p;
   p.isAck = false;
   p.isFin = true;
+  p.isReq = false;
   p.seq = 0;
+  p.epoch = 0;
   p.data = NULL;
   p.length = 0;
   return p;
@@ -47,7 +56,22 @@ Packet makeFinAck() {
   Packet p;
   p.isAck = true;
   p.isFin = true;
+  p.isReq = false;
   p.seq = 0;
+  p.epoch = 0;
+  p.data = NULL;
+  p.length = 0;
+  return p;
+}
+
+// Caller must set data and length fields
+Packet makeReq(uint32_t epoch) {
+  Packet p;
+  p.isAck = false;
+  p.isFin = false;
+  p.isReq = true;
+  p.seq = 0;
+  p.epoch = epoch;
   p.data = NULL;
   p.length = 0;
   return p;
@@ -60,22 +84,106 @@ Packet makeFinAck() {
  * The passed in data array is freed.
  */
 void parsePacket(const uint8_t *const data, size_t length, Packet *packet) {
+  bool parsed = parseHeader(data, length, packet);
+  assert(parsed);
+
+  // Have the packet have its own copy of the data
+  const uint8_t *payload = packet->data;
+  packet->data = (uint8_t *)malloc(packet->length * sizeof(uint8_t));
+  assert(packet->data);
+  memcpy(packet->data, payload, packet->length);
+}
+
+void setAckWindow(Packet *ack, uint8_t *window, uint32_t bytes) {
+  uint32_t field = htonl(bytes);
+  memcpy(window, &field, sizeof(field));
+  ack->data = window;
+  ack->length = ACK_WINDOW_LENGTH;
+}
+
+bool getAckWindow(const Packet *const ack, uint32_t *bytes) {
+  if (!ack->isAck || ack->length < (size_t)ACK_WINDOW_LENGTH) {
+    return false;
+  }
+
+  uint32_t field;
+  memcpy(&field, ack->data, sizeof(field));
+  *bytes = ntohl(field);
+  return true;
+}
+
+void setFinHash(Packet *fin, uint8_t *hash, uint64_t digest) {
+  for (int i = 0; i < FIN_HASH_LENGTH; i++) {
+    hash[i] = (uint8_t)(digest >> (56 - 8 * i));
+  }
+  fin->data = hash;
+  fin->length = FIN_HASH_LENGTH;
+}
+
+bool getFinHash(const Packet *const fin, uint64_t *digest) {
+  if (!fin->isFin || fin->isAck || fin->length < (size_t)FIN_HASH_LENGTH) {
+    return false;
+  }
+
+  *digest = 0;
+  for (int i = 0; i < FIN_HASH_LENGTH; i++) {
+    *digest = (*digest << 8) | fin->data[i];
+  }
+  return true;
+}
+
+/**
+ * Read a byte array (a serialized packet) into a packet without copying.
+ * The packet's data points into the passed in array, and must not be freed.
+ * Returns false if the array is too short to hold a header.
+ */
+bool parseHeader(const uint8_t *const data, size_t length, Packet *packet) {
+  if (length < (size_t)PACKET_HEADER_LENGTH) {
+    return false;
+  }
+
   // Parse flags
   const uint8_t flags = data[0];
   packet->isAck = flags & FLAG_ACK;
   packet->isFin = flags & FLAG_FIN;
+  packet->isReq = flags & FLAG_REQ;
 
-  // Parse sequence number
-  const uint32_t *dataAs32Bit = (uint32_t *)(&data[1]);
-  packet->seq = ntohl(dataAs32Bit[0]);
+  // Parse sequence number and epoch
+  uint32_t field;
+  memcpy(&field, &data[1], sizeof(field));
+  packet->seq = ntohl(field);
+  memcpy(&field, &data[5], sizeof(field));
+  packet->epoch = ntohl(field);
 
   // Parse data
   packet->length = length - PACKET_HEADER_LENGTH;
+  packet->data = (uint8_t *)&data[PACKET_HEADER_LENGTH];
+  return true;
+}
 
-  // Have the packet have its own copy of the data
-  packet->data = (uint8_t *)malloc(packet->length * sizeof(uint8_t));
-  assert(packet->data);
-  memcpy(packet->data, (uint8_t *)&dataAs32Bit[1], packet->length);
+/**
+ * Write just the header of a packet into header, which must hold
+ * PACKET_HEADER_LENGTH bytes.  The payload goes on the wire right after it.
+ */
+void serializeHeader(const Packet *const packet, uint8_t *header) {
+  // Create flags
+  uint8_t flags = 0;
+  if (packet->isAck) {
+    flags |= FLAG_ACK;
+  }
+  if (packet->isFin) {
+    flags |= FLAG_FIN;
+  }
+  if (packet->isReq) {
+    flags |= FLAG_REQ;
+  }
+  header[0] = flags;
+
+  // Setup the sequence number and epoch
+  uint32_t field = htonl(packet->seq);
+  memcpy(&header[1], &field, sizeof(field));
+  field = htonl(packet->epoch);
+  memcpy(&header[5], &field, sizeof(field));
 }
 
 /**
@@ -86,25 +194,13 @@ void parsePacket(const uint8_t *const data, size_t length, Packet *packet) {
 size_t serializePacket(const Packet *const packet, uint8_t **buffer) {
   // Total serialized length includes packet data and header
   size_t serializeLength = packet->length + PACKET_HEADER_LENGTH;
-  assert(serializeLength <= MAX_PACKET_SIZE);
+  assert(serializeLength <= (size_t)MAX_PACKET_SIZE);
 
   uint8_t *data = (uint8_t *)malloc(serializeLength * sizeof(uint8_t));
   assert(data);
 
   // Setup the header
-  // Create flags
-  uint8_t flags = 0;
-  if (packet->isAck) {
-    flags |= FLAG_ACK;
-  }
-  if (packet->isFin) {
-    flags |= FLAG_FIN;
-  }
-  data[0] = flags;
-
-  // Setup the sequence number
-  uint32_t *dataAs32Bit = (uint32_t *)(&data[1]);
-  dataAs32Bit[0] = htonl(packet->seq);
+  serializeHeader(packet, data);
 
   // Copy over the packet data
   memcpy(&data[PACKET_HEADER_LENGTH], packet->data, packet->length);
@@ -118,8 +214,9 @@ size_t serializePacket(const Packet *const packet, uint8_t **buffer) {
  */
 void printPacket(const Packet *const p) {
   printf("Packet:\n");
-  printf("\tFLAG_ACK: %d\n\tFLAG_FIN: %d\n\tSEQ: %d\n\tDATA (%zu bytes):",
-         p->isAck, p->isFin, p->seq, p->length);
+  printf("\tFLAG_ACK: %d\n\tFLAG_FIN: %d\n\tFLAG_REQ: %d\n\tSEQ: %d\n"
+         "\tEPOCH: %u\n\tDATA (%zu bytes):",
+         p->isAck, p->isFin, p->isReq, p->seq, p->epoch, p->length);
   for (size_t i = 0; i < p->length; i++) {
     printf(" 0x%02x", p->data[i]);
   }
@@ -17,14 +17,19 @@
 extern const int MAX_PACKET_SIZE;    // number of bytes
 extern const int PACKET_HEADER_LENGTH;  // number of bytes
 extern const int MAX_SEQ_NUM;
+extern const int ACK_WINDOW_LENGTH;     // number of bytes
+extern const int FIN_HASH_LENGTH;       // number of bytes
 
 extern const int FLAG_ACK;
 extern const int FLAG_FIN;
+extern const int FLAG_REQ;
 
 typedef struct Packet {
   bool isAck;     // ack flag
   bool isFin;     // fin flag
+  bool isReq;     // req flag, the packet carries a request
   uint32_t seq;   // seq number
+  uint32_t epoch; // connection the packet belongs to
   uint8_t *data;  // byte array received from socket, excluding header
   size_t length;  // length of data section
 } Packet;
@@ -38,6 +43,33 @@ Packet makeFin();
 
 Packet makeFinAck();
 
+// Caller must set data and length fields
+Packet makeReq(uint32_t epoch);
+
+/**
+ * Advertise the receiver's free buffer space in an ACK.  The space is
+ * encoded into window, which must hold ACK_WINDOW_LENGTH bytes and becomes
+ * the ACK's payload.
+ */
+void setAckWindow(Packet *ack, uint8_t *window, uint32_t bytes);
+
+/**
+ * Read the free buffer space advertised in an ACK.  Returns false if the ACK
+ * does not advertise any.
+ */
+bool getAckWindow(const Packet *const ack, uint32_t *bytes);
+
+/**
+ * Carry the hash of the whole stream in a FIN.  The digest is encoded into
+ * hash, which must hold FIN_HASH_LENGTH bytes and becomes the FIN's payload.
+ */
+void setFinHash(Packet *fin, uint8_t *hash, uint64_t digest);
+
+/**
+ * Read the stream hash carried in a FIN.  Returns false if it has none.
+ */
+bool getFinHash(const Packet *const fin, uint64_t *digest);
+
 /**
  * Read a byte array (a serialized packet) into a packet.
  * The packet must later be freed with freePacket, and the passed in
@@ -46,6 +78,19 @@ Packet makeFinAck();
  */
 void parsePacket(const uint8_t *const data, size_t length, Packet *packet);
 
+/**
+ * Read a byte array (a serialized packet) into a packet without copying.
+ * The packet's data points into the passed in array, and must not be freed.
+ * Returns false if the array is too short to hold a header.
+ */
+bool parseHeader(const uint8_t *const data, size_t length, Packet *packet);
+
+/**
+ * Write just the header of a packet into header, which must hold
+ * PACKET_HEADER_LENGTH bytes.  The payload goes on the wire right after it.
+ */
+void serializeHeader(const Packet *const packet, uint8_t *header);
+
 /**
  * Serialize a packet into a uint8_t buffer, including our header information.
  * It is the caller's responsibility to free the serialization.
@@ -0,0 +1,110 @@
+#include "profile.h"
+
+#include <string.h>
+
+#include "pacer.h"
+
+typedef struct PhaseTotal {
+  uint64_t nanos;
+  uint64_t count;
+} PhaseTotal;
+
+// Frames of each phase in the folded stacks, outermost first
+static const char *const PHASE_FRAMES[NUM_PHASES] = {
+    "receive;select",
+    "receive;recvfrom",
+    "receive;log",
+    "receive;input",
+    "send;output",
+    "send;sendmsg",
+    "send;log",
+    "timers",
+    "deliver;read",
+    "deliver;sink",
+    "produce",
+};
+
+static bool enabled = false;
+static PhaseTotal totals[NUM_PHASES];
+static uint64_t since = 0;  // start of the wall clock
+
+void profileEnable(bool enable) {
+  enabled = enable;
+  profileReset();
+}
+
+bool profileEnabled() {
+  return enabled;
+}
+
+uint64_t profileStart() {
+  return enabled ? monotonicNanos() : 0;
+}
+
+void profileEnd(ProfilePhase phase, uint64_t start) {
+  if (!enabled) {
+    return;
+  }
+  // Transfers may run on several threads at once
+  __atomic_fetch_add(&totals[phase].nanos, monotonicNanos() - start,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&totals[phase].count, 1, __ATOMIC_RELAXED);
+}
+
+void profileReset() {
+  memset(totals, 0, sizeof(totals));
+  since = monotonicNanos();
+}
+
+static uint64_t accounted() {
+  uint64_t nanos = 0;
+  for (int i = 0; i < NUM_PHASES; i++) {
+    nanos += totals[i].nanos;
+  }
+  return nanos;
+}
+
+/**
+ * Wall time since the reset that no phase accounts for.  With transfers on
+ * several threads, the phases may add up to more than the wall time.
+ */
+static uint64_t unaccounted(uint64_t wall) {
+  uint64_t nanos = accounted();
+  return nanos < wall ? wall - nanos : 0;
+}
+
+void profileReport(FILE *out) {
+  uint64_t wall = monotonicNanos() - since;
+  uint64_t whole = wall > accounted() ? wall : accounted();
+  double percent = whole ? 100.0 / whole : 0.0;
+
+  fprintf(out, "Profile over %.3f ms:\n", wall / 1e6);
+  fprintf(out, "  %-18s %12s %6s %10s %10s\n", "phase", "total ms", "%",
+          "calls", "mean us");
+  for (int i = 0; i < NUM_PHASES; i++) {
+    if (!totals[i].count) {
+      continue;
+    }
+    fprintf(out, "  %-18s %12.3f %6.1f %10llu %10.2f\n", PHASE_FRAMES[i],
+            totals[i].nanos / 1e6, totals[i].nanos * percent,
+            (unsigned long long)totals[i].count,
+            totals[i].nanos / 1e3 / totals[i].count);
+  }
+  uint64_t other = unaccounted(wall);
+  fprintf(out, "  %-18s %12.3f %6.1f\n", "other", other / 1e6,
+          other * percent);
+}
+
+void profileWriteFolded(FILE *out, const char *root) {
+  for (int i = 0; i < NUM_PHASES; i++) {
+    uint64_t micros = totals[i].nanos / 1000;
+    if (micros) {
+      fprintf(out, "%s;%s %llu\n", root, PHASE_FRAMES[i],
+              (unsigned long long)micros);
+    }
+  }
+  uint64_t other = unaccounted(monotonicNanos() - since) / 1000;
+  if (other) {
+    fprintf(out, "%s;other %llu\n", root, (unsigned long long)other);
+  }
+}
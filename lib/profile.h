@@ -0,0 +1,56 @@
+#ifndef LIB_PROFILE
+#define LIB_PROFILE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Optional profiler for the transfer loops.  Each phase of a loop is timed
+ * with the monotonic clock and added up, so a report can show where the
+ * time of a transfer went.  Phases timed on different threads add up.  When
+ * the profiler is off, timing a phase costs a branch and no clock reads.
+ */
+typedef enum ProfilePhase {
+  PHASE_WAIT,         // select, waiting for a packet or a timer
+  PHASE_RECVFROM,     // taking a datagram from the kernel
+  PHASE_RECEIVE_LOG,  // printing received packets
+  PHASE_INPUT,        // ACK and data processing
+  PHASE_OUTPUT,       // choosing and building the next datagram
+  PHASE_SENDMSG,      // handing a datagram to the kernel
+  PHASE_SEND_LOG,     // printing sent packets
+  PHASE_TIMERS,       // timeouts and retransmission
+  PHASE_READ,         // copying the received stream out of the window
+  PHASE_SINK,         // writing the received stream out
+  PHASE_PRODUCE,      // loading and packing what the server sends
+  NUM_PHASES
+} ProfilePhase;
+
+void profileEnable(bool enable);
+
+bool profileEnabled();
+
+/**
+ * Start timing a phase.  Returns the time to hand to profileEnd.
+ */
+uint64_t profileStart();
+
+void profileEnd(ProfilePhase phase, uint64_t start);
+
+/**
+ * Forget everything timed so far, and start the wall clock over
+ */
+void profileReset();
+
+/**
+ * Print how the time since the last reset was spent, phase by phase
+ */
+void profileReport(FILE *out);
+
+/**
+ * Write the phases as folded stacks under root, one "root;frame;... micros"
+ * line each, as flamegraph.pl takes them
+ */
+void profileWriteFolded(FILE *out, const char *root);
+
+#endif  // LIB_PROFILE
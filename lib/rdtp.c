@@ -8,42 +8,87 @@
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
-
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef SO_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+
+#include "connection.h"
 #include "packet.h"
+#include "pacer.h"
+#include "profile.h"
+
+Config makeConfig() {
+  Config config;
+  config.pC = 0.0;
+  config.pL = 0.0;
+  config.windowSize = 5000;
+  config.timeout_sec = 0;
+  config.timeout_usec = 5000;
+  config.pacingRate = 0.0;
+  config.txTime = false;
+  config.dupAckThreshold = 3;
+  return config;
+}
 
-// Keep the timeout as small as possible to increase transfer rate
-const int MAX_FIN_ATTEMPT = 50;
-
-// Number of times the receiver will receive TIMEDOUT before assuming
-// loss of connection.
-const int MAX_WAIT_ATTEMPTS = 500;
-const int MAX_SEND_ATTEMPTS = 500;
-
-typedef enum { OK, CORRUPTED, TIMEDOUT, LOST } STATUS;
-
-// Struct to represent a window
-typedef struct Window {
-  ssize_t min;
-  ssize_t max;
-} Window;
+/**
+ * Convert nanoseconds to a timeval, rounding up to the next microsecond
+ */
+struct timeval nanosToTimeval(uint64_t nanos) {
+  uint64_t micros = (nanos + 999) / 1000;
+  struct timeval tv;
+  tv.tv_sec = micros / 1000000;
+  tv.tv_usec = micros % 1000000;
+  return tv;
+}
 
 /**
- * Send a singular packet of any type
+ * Send a datagram pulled from a connection.  The header and payload are
+ * gathered by the kernel, so nothing is built or copied here.
+ * A non-zero txTime asks the kernel to hold the packet until that
+ * CLOCK_MONOTONIC time, on sockets set up by enableTxTime.
  */
-void sendPacket(Packet *p, int sockfd, const struct sockaddr *destAddr,
-                socklen_t destLen) {
+void sendDatagram(const Datagram *datagram, int sockfd,
+                  const struct sockaddr *destAddr, socklen_t destLen) {
   // Print for debugging
-  printPacket(p);
-
-  // Serialize the packet
-  uint8_t *temp;
-  size_t length = serializePacket(p, &temp);
+  uint64_t started = profileStart();
+  Packet p;
+  parseHeader((const uint8_t *)datagram->iov[0].iov_base,
+              datagram->iov[0].iov_len, &p);
+  if(2 == datagram->iovlen) {
+    p.data = (uint8_t *)datagram->iov[1].iov_base;
+    p.length = datagram->iov[1].iov_len;
+  }
+  printPacket(&p);
+  profileEnd(PHASE_SEND_LOG, started);
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)destAddr;
+  msg.msg_namelen = destLen;
+  msg.msg_iov = (struct iovec *)datagram->iov;
+  msg.msg_iovlen = datagram->iovlen;
+
+#ifdef SO_TXTIME
+  char control[CMSG_SPACE(sizeof(uint64_t))];
+  if(datagram->txTime) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &datagram->txTime, sizeof(uint64_t));
+  }
+#endif
 
   // Send the packet
-  ssize_t bytesSent = sendto(sockfd, temp, length, 0, destAddr, destLen);
-
-  // Clean up
-  free(temp);
+  started = profileStart();
+  ssize_t bytesSent = sendmsg(sockfd, &msg, 0);
+  profileEnd(PHASE_SENDMSG, started);
 
   // Handle errors
   if(-1 == bytesSent) {
@@ -52,159 +97,327 @@ void sendPacket(Packet *p, int sockfd, const struct sockaddr *destAddr,
 }
 
 /**
- * Receive a singular packet of any type
+ * Let the kernel pace this socket's packets by the departure times given to
+ * sendDatagram.  Returns false where SO_TXTIME is not available.
  */
-Packet receivePacket(int sockfd, struct sockaddr *fromAddress,
-                     socklen_t *fromAddressLen, STATUS *status,
-                     Config config, bool isFirstPacket) {
-  *status = OK;
-  uint8_t buffer[MAX_PACKET_SIZE];
+bool enableTxTime(int sockfd) {
+#ifdef SO_TXTIME
+  struct sock_txtime txtime;
+  memset(&txtime, 0, sizeof(txtime));
+  txtime.clockid = CLOCK_MONOTONIC;
+  return 0 == setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &txtime,
+                         sizeof(txtime));
+#else
+  return false;
+#endif
+}
 
+/**
+ * Wait up to tv for a datagram
+ */
+ssize_t receiveDatagram(int sockfd, uint8_t *buffer,
+                        struct sockaddr *fromAddress,
+                        socklen_t *fromAddressLen, Config config,
+                        struct timeval tv) {
   // Enable timeout
-  struct timeval tv;
-  tv.tv_sec = config.timeout_sec;  // 3 second timeout
-  tv.tv_usec = config.timeout_usec;
   fd_set sockets;
   FD_ZERO(&sockets);
   FD_SET(sockfd, &sockets);
 
-  Packet ret;
-  if (select(sockfd + 1, &sockets, NULL, NULL, &tv)) {
-    ssize_t bytesRec = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0, fromAddress,
-                                fromAddressLen);
-    assert(-1 != bytesRec);  // TODO replace with proper error handling later
-    // Parse out the packet
-    parsePacket(buffer, bytesRec, &ret);
-
-    // Print packet for debugging
-    printPacket(&ret);
-    // Check if corrupted
-    int r = (rand() % 100) + 1; // [1,100]
-    *status = r <= (config.pC * 100) ? CORRUPTED : OK;
-    *status = r <= (config.pL * 100) ? LOST : *status;
-    if(*status == CORRUPTED) {
-      printf("\x1B[31m" "\t(CORRUPTED)\n" "\x1B[0m");
-    } else if(*status == LOST) {
-      printf("\x1B[31m" "\t(LOST)\n" "\x1B[0m");
-    }
-  } else {
+  uint64_t started = profileStart();
+  int ready = select(sockfd + 1, &sockets, NULL, NULL, &tv);
+  profileEnd(PHASE_WAIT, started);
+  if (ready <= 0) {
     // Timed out
-    *status = TIMEDOUT;
-
-    // Don't 'time out' if simply waiting for the first packet
-    if(!isFirstPacket) {
-      printf(
-          "\x1B[31m"
-          "\t(TIMED OUT)\n"
-          "\x1B[0m");
+    return -1;
+  }
+
+  started = profileStart();
+  ssize_t bytesRec = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0, fromAddress,
+                              fromAddressLen);
+  profileEnd(PHASE_RECVFROM, started);
+  if (-1 == bytesRec) {
+    if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+      printf("receiveDatagram Error: %s\n", strerror(errno));
     }
+    return -1;
+  }
+
+  // Parse out the packet
+  Packet ret;
+  if (!parseHeader(buffer, bytesRec, &ret)) {
+    // Too short to be one of ours
+    return 0;
+  }
+
+  // Print packet for debugging
+  started = profileStart();
+  printPacket(&ret);
+  profileEnd(PHASE_RECEIVE_LOG, started);
+  // Check if corrupted
+  int r = (rand() % 100) + 1; // [1,100]
+  if(r <= (config.pL * 100)) {
+    printf("\x1B[31m" "\t(LOST)\n" "\x1B[0m");
+    return 0;
+  } else if(r <= (config.pC * 100)) {
+    printf("\x1B[31m" "\t(CORRUPTED)\n" "\x1B[0m");
+    return 0;
   }
 
-  return ret;
+  return bytesRec;
 }
 
 /**
- * Receive a byte array
+ * Check if two socket addresses refer to the same peer
  */
-Buffer receiveBytes(int sockfd, struct sockaddr *fromAddress,
-                    socklen_t *fromAddressLen, Config config) {
-  Buffer recBytes;
-  recBytes.data = NULL;
-  recBytes.length = 0;
+bool sameAddress(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) {
+    return false;
+  }
+  if (AF_INET == a->sa_family) {
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+    return a4->sin_port == b4->sin_port &&
+           a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  }
+  if (AF_INET6 == a->sa_family) {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+    return a6->sin6_port == b6->sin6_port &&
+           0 == memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+  }
+  return false;
+}
+
+/**
+ * Sink that reassembles the stream in a growing Buffer
+ */
+bool bufferSink(void *ctx, size_t offset, const uint8_t *data,
+                size_t length) {
+  Buffer *recBytes = (Buffer *)ctx;
+
+  // Grow buffer if need  be
+  if(recBytes->length < offset + length) {
+    recBytes->data = (uint8_t *)realloc(recBytes->data, offset + length);
+    assert(recBytes->data);
+    recBytes->length = offset + length;
+  }
+
+  // Copy in the data
+  memcpy(&recBytes->data[offset], data, length);
+  return true;
+}
 
-  int timeOuts = 0;
-  bool isFirstPacket = true;
+// Sink context for writing the stream straight into a file
+typedef struct FileSink {
+  int fd;
+  off_t base;     // file offset of the first byte of the stream
+  size_t length;  // bytes of the stream seen so far
+} FileSink;
 
-  int numRollovers = 0; // number of times seq rolls over MAX_SEQ_NUM
-  Window window;
-  window.min = 0;
-  window.max = config.windowSize;
+/**
+ * Sink that pwrites the stream at its place in a file
+ */
+bool fileSink(void *ctx, size_t offset, const uint8_t *data, size_t length) {
+  FileSink *file = (FileSink *)ctx;
+
+  size_t written = 0;
+  while(written < length) {
+    ssize_t rv = pwrite(file->fd, data + written, length - written,
+                        file->base + offset + written);
+    if(-1 == rv) {
+      if(EINTR == errno) {
+        continue;
+      }
+      printf("fileSink Error: %s\n", strerror(errno));
+      return false;
+    }
+    written += rv;
+  }
+
+  if(file->length < offset + length) {
+    file->length = offset + length;
+  }
+  return true;
+}
+
+/**
+ * Run a connection over a socket until it is done or fails, handing the
+ * stream it receives to the sink.  If lockPeer is set, the first packet of
+ * the connection fixes the peer's address in addr, and packets from any
+ * other address are dropped afterwards.
+ */
+ConnectionState driveConnection(Connection *conn, int sockfd,
+                                struct sockaddr *addr, socklen_t *addrLen,
+                                bool lockPeer, Config config, Sink sink,
+                                void *ctx) {
+  uint8_t buffer[MAX_PACKET_SIZE];
+  uint8_t chunk[16 * 1024];
+  size_t delivered = 0;
+  bool locked = false;
 
   while (1) {
-    STATUS status;
-    Packet rec =
-        receivePacket(sockfd, fromAddress, fromAddressLen, &status, config, isFirstPacket);
+    uint64_t now = monotonicNanos();
 
-    // Eat finacks from old connection
-    if(rec.isFin && rec.isAck) {
-      continue;
+    // Send whatever the connection has for us
+    Datagram datagram;
+    while (connectionOutput(conn, now, &datagram)) {
+      sendDatagram(&datagram, sockfd, addr, *addrLen);
     }
 
-    // Handle loss of connection
-    if(TIMEDOUT  == status && !isFirstPacket) {
-      timeOuts++;
-      if(MAX_WAIT_ATTEMPTS < timeOuts) {
+    // Hand over the stream received so far
+    size_t length;
+    while (sink && (length = connectionRead(conn, chunk, sizeof(chunk)))) {
+      uint64_t started = profileStart();
+      bool taken = sink(ctx, delivered, chunk, length);
+      profileEnd(PHASE_SINK, started);
+      if (!taken) {
+        return CONNECTION_FAILED;
+      }
+      delivered += length;
+    }
+
+    ConnectionState state = connectionState(conn);
+    if (state != CONNECTION_OPEN) {
+      if (state == CONNECTION_FAILED) {
         printf(
             "\x1B[31m"
             "\t(Connection Lost)\n"
             "\x1B[0m");
-        break;
+      } else if (state == CONNECTION_CORRUPTED) {
+        printf(
+            "\x1B[31m"
+            "\t(Stream Hash Mismatch)\n"
+            "\x1B[0m");
       }
+      return state;
     }
 
-    // If we RXed a packet, then reset the timeout counter
-    if(CORRUPTED == status || OK == status) {
-      isFirstPacket = false;
-      timeOuts = 0;
+    // Wait for a packet, or until the connection's timer is due
+    uint64_t deadline = connectionDeadline(conn);
+    struct timeval tv;
+    tv.tv_sec = config.timeout_sec;
+    tv.tv_usec = config.timeout_usec;
+    if (deadline != UINT64_MAX) {
+      tv = nanosToTimeval(deadline > now ? deadline - now : 0);
     }
 
-    // Ignore corrupted packets
-    if(status != OK) {
-      continue;
-    }
+    struct sockaddr_storage from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t bytesRec = receiveDatagram(sockfd, buffer,
+                                       (struct sockaddr *)&from, &fromLen,
+                                       config, tv);
+    now = monotonicNanos();
 
-    // Handle different packet types
-    if (!rec.isAck && !rec.isFin) {
-      // Figure out the absolute offset
-      ssize_t offset = rec.seq + (numRollovers * MAX_SEQ_NUM);
-      /*printf("Offset: %zd, WindowMin: %zd\n", offset, window.min);*/
-      if(offset <= window.min - config.windowSize) {
-        /*printf("ROLLED OVER\n");*/
-        numRollovers++;
-      }
-      offset = rec.seq + (numRollovers * MAX_SEQ_NUM);  // recalc the offset
-      // Adjust for window straddling the rollover point
-      if(window.max + config.windowSize <= offset) {
-        offset = rec.seq + ((numRollovers -1) * MAX_SEQ_NUM);
-      }
-      // Move the window if needed
-      if(window.max < offset) {
-        window.max = offset;
-        window.min = window.max - config.windowSize;
+    Packet rec;
+    if (0 < bytesRec && parseHeader(buffer, bytesRec, &rec) &&
+        rec.epoch == connectionEpoch(conn)) {
+      if (lockPeer && !locked) {
+        memcpy(addr, &from, fromLen);
+        *addrLen = fromLen;
+        locked = true;
       }
-      /*printf("Offset: %zd, WindowMin: %zd\n", offset, window.min);*/
-
-      // Grow buffer if need  be
-      if(recBytes.length < offset + rec.length) {
-        recBytes.data =
-            (uint8_t *)realloc(recBytes.data, offset + rec.length);
-        recBytes.length = offset + rec.length;
+      if (!lockPeer || sameAddress((struct sockaddr *)&from, addr)) {
+        connectionInput(conn, buffer, bytesRec, now);
       }
+    }
 
-      // Copy in the data
-      memcpy(&recBytes.data[offset], rec.data, rec.length);
-      /*printf(*/
-      /*    "\x1B[31m"*/
-      /*    "(SAVED AT OFFSET %zd)\n"*/
-      /*    "\x1B[0m", offset);*/
-
-      // Send ACK
-      Packet ack = makeAck(rec.seq);
-      freePacket(&rec); // only need to free TRN packets
-
-      assert(status == OK);
-      sendPacket(&ack, sockfd, fromAddress, *fromAddressLen);
-    } else if (!rec.isAck && rec.isFin) {
-      // Send FINACK
-      Packet finAck = makeFinAck();
-      sendPacket(&finAck, sockfd, fromAddress, *fromAddressLen);
-      break;
+    if (connectionDeadline(conn) <= now) {
+      connectionTick(conn, now);
     }
   }
+}
+
+/**
+ * Send a request and receive the byte stream that answers it, handing it to
+ * the sink.  Returns how the connection ended.
+ */
+ConnectionState requestStream(Buffer request, int sockfd,
+                              struct sockaddr *addr, socklen_t *addrLen,
+                              Config config, Sink sink, void *ctx) {
+  Connection *conn = makeClientConnection(request, config, monotonicNanos());
+  if (!conn) {
+    printf("requestStream Error: request of %zu bytes does not fit in a "
+           "packet\n", request.length);
+    return CONNECTION_FAILED;
+  }
+
+  ConnectionState state = driveConnection(conn, sockfd, addr, addrLen, true,
+                                          config, sink, ctx);
+  freeConnection(conn);
+  return state;
+}
+
+/**
+ * Request a byte array
+ */
+Buffer requestBytes(Buffer request, int sockfd, struct sockaddr *addr,
+                    socklen_t *addrLen, Config config) {
+  Buffer recBytes;
+  recBytes.data = NULL;
+  recBytes.length = 0;
+
+  if (CONNECTION_DONE != requestStream(request, sockfd, addr, addrLen, config,
+                                      bufferSink, &recBytes)) {
+    // Never hand back a stream that was cut short or failed its hash
+    freeBuffer(&recBytes);
+    recBytes.data = NULL;
+    recBytes.length = 0;
+  }
 
   return recBytes;
 }
 
+/**
+ * Request a byte stream directly into a file
+ */
+ssize_t requestToFile(Buffer request, int fd, off_t base, int sockfd,
+                      struct sockaddr *addr, socklen_t *addrLen,
+                      Config config) {
+  FileSink file;
+  file.fd = fd;
+  file.base = base;
+  file.length = 0;
+
+  if (CONNECTION_DONE != requestStream(request, sockfd, addr, addrLen, config,
+                                      fileSink, &file)) {
+    return -1;
+  }
+
+  return file.length;
+}
+
+/**
+ * Wait for a request, and return its bytes
+ */
+Buffer receiveRequest(int sockfd, struct sockaddr *fromAddress,
+                      socklen_t *fromAddressLen, uint32_t *epoch,
+                      Config config) {
+  uint8_t buffer[MAX_PACKET_SIZE];
+  const socklen_t addrLen = *fromAddressLen;
+  while (1) {
+    struct timeval tv;
+    tv.tv_sec = config.timeout_sec;
+    tv.tv_usec = config.timeout_usec;
+    *fromAddressLen = addrLen;
+    ssize_t bytesRec = receiveDatagram(sockfd, buffer, fromAddress,
+                                       fromAddressLen, config, tv);
+
+    // Anything but a REQ is left over from a finished connection
+    Packet rec;
+    if (0 < bytesRec && parseHeader(buffer, bytesRec, &rec) && rec.isReq &&
+        0 < rec.length) {
+      Buffer request;
+      request.data = (uint8_t *)malloc(rec.length);
+      assert(request.data);
+      memcpy(request.data, rec.data, rec.length);
+      request.length = rec.length;
+      *epoch = rec.epoch;
+      return request;
+    }
+  }
+}
+
 /**
  * Calculate how many packets are required to send a buffer
  */
@@ -218,11 +431,6 @@ int numPacketsRequired(Buffer buf) {
   return base;
 }
 
-/**
- * Create an array of TRN packets that point into buf
- * The caller should NOT free the packets, as they point into buf.
- * The caller should free the packet list, though.
- */
 int packetize(Buffer buf, Packet **packets) {
   const int max_packet_data = MAX_PACKET_SIZE - PACKET_HEADER_LENGTH;
   int numPackets = numPacketsRequired(buf);
@@ -244,115 +452,39 @@ int packetize(Buffer buf, Packet **packets) {
 }
 
 /**
- * Return the index of the first unack'd packet
- */
-int firstUnacked(Packet *packets, int num) {
-  for(int i=0; i<num; i++) {
-    if(!packets[i].isAck)
-      return i;
-  }
-
-  return -1;
-}
-
-/**
- * Return the offset into the byte stream of a packet at index
+ * Send a stream that has already been cut into packets.  The packets are
+ * only read, so one packet array can be shared by many transfers at once.
  */
-ssize_t offset(Packet *packets, int index) {
-  int rollOvers = 0;
-
-  for(int i=1; i<=index; i++) {
-    if(packets[i].seq < packets[i-1].seq) {
-      rollOvers++;
-    }
-  }
-
-  return packets[index].seq + (MAX_SEQ_NUM * rollOvers);
+bool sendPackets(const Packet *packets, int numPackets, uint32_t epoch,
+                 int sockfd, const struct sockaddr *destAddr,
+                 socklen_t destLen, Config config) {
+  config.txTime = config.txTime && enableTxTime(sockfd);
+
+  Connection *conn = makeServerConnection(epoch, config, monotonicNanos());
+  connectionSendPackets(conn, packets, numPackets, NULL, NULL);
+  connectionFinish(conn);
+
+  socklen_t addrLen = destLen;
+  ConnectionState state = driveConnection(
+      conn, sockfd, (struct sockaddr *)destAddr, &addrLen, false, config,
+      NULL, NULL);
+  freeConnection(conn);
+  return state == CONNECTION_DONE;
 }
 
 /**
  * Send a byte array
  */
-bool sendBytes(Buffer buf, int sockfd, const struct sockaddr *destAddr,
-               socklen_t destLen, Config config) {
+bool sendBytes(Buffer buf, uint32_t epoch, int sockfd,
+               const struct sockaddr *destAddr, socklen_t destLen,
+               Config config) {
   // Packetize the data
   Packet *packets;
   int numPackets = packetize(buf, &packets);
-  STATUS status;
-  int sendAttempts = 0;
-  Window window;
-  window.min = 0;
-  window.max = config.windowSize;
-
-  // Eat old connection's FIN packets
-  Packet oldFin;
-  do {
-    oldFin = receivePacket(sockfd, NULL, NULL, &status, config, false);
-    if(OK == status) {
-      assert(oldFin.isFin);
-    }
-  } while(TIMEDOUT != status);
 
-  while(-1 != firstUnacked(packets, numPackets)) {
-    // If nobody is listening, let the sender timeout
-    if(MAX_SEND_ATTEMPTS < sendAttempts) {
-      return false;
-    }
-    sendAttempts++;
-
-    // Move window up if need be
-    int index = firstUnacked(packets, numPackets);
-    window.min = offset(packets, index);
-    window.max = window.min + config.windowSize;
-
-    // Send all packets with seq in window
-    for(int i=index; i<numPackets; i++) {
-      // Only send packets in window size
-      if(window.max < offset(packets, i)) {
-        break;
-      }
-
-      // Send if unacked
-      if(!packets[i].isAck) {
-        // Send packet
-        sendPacket(&packets[i], sockfd, destAddr, destLen);
-      }
-    }
+  bool sent = sendPackets(packets, numPackets, epoch, sockfd, destAddr,
+                          destLen, config);
 
-    // RX all acks
-    Packet rec;
-    do {
-      rec = receivePacket(sockfd, NULL, NULL, &status, config, false);
-      if(OK == status && rec.isAck) {
-        for(int i=index; i<numPackets; i++) {
-          if(window.max < offset(packets, i)) {
-            break;
-          }
-          if(rec.seq == packets[i].seq) {
-            packets[i].isAck = true;
-            sendAttempts = 0;
-          }
-        }
-      }
-    } while(status != TIMEDOUT);
-  }
-
-  // Send FIN
-  Packet finAck;
-  int attempts = 0;
-  do {
-    attempts++;
-    Packet fin = makeFin();
-    sendPacket(&fin, sockfd, destAddr, destLen);
-
-    // Handle FINACK
-    finAck = receivePacket(sockfd, NULL, NULL, &status, config, false);
-
-    // If other side started transmitting
-    if(OK == status && !finAck.isAck && !fin.isFin) {
-      break;
-    }
-  } while(status != OK && attempts < MAX_FIN_ATTEMPT);
-
-  return true;
+  free(packets);
+  return sent;
 }
@@ -3,34 +3,110 @@
 
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <sys/time.h>
+#include <sys/types.h>
 
 #include "buffer.h"
+#include "config.h"
+#include "connection.h"
+#include "packet.h"
 
 /**
- * Configuration struct for tweaking the parameters of RDTP
+ * Client side of a transfer: send a request in a single REQ packet and
+ * receive the byte stream the server answers with.  The answer may come from
+ * another address than addr, which is updated to the address it came from.
+ * Returns an empty buffer if nothing came back, the transfer broke off, or
+ * the stream did not match the hash the server sent with its FIN.
  */
-typedef struct Config {
-  double pC;
-  double pL;
-  int windowSize;
-  int timeout_sec;
-  int timeout_usec;
-} Config;
+Buffer requestBytes(Buffer request, int sockfd, struct sockaddr *addr,
+                    socklen_t *addrLen, Config config);
 
 /**
- * recvfrom
- * NEED:
- * sockfd
- * buffer
- * bufferlength
- * flags
- * sockaddr address (their address)
- * socklen_t address_len,
+ * A sink consumes the stream in order, length bytes at a time starting at
+ * offset.  Returns false if the data could not be stored.
  */
-Buffer receiveBytes(int sockfd, struct sockaddr *restrict fromAddress,
-                    socklen_t *restrict fromAddressLen, Config config);
+typedef bool (*Sink)(void *ctx, size_t offset, const uint8_t *data,
+                     size_t length);
 
-bool sendBytes(Buffer buf, int sockfd, const struct sockaddr *destAddr,
-               socklen_t destLen, Config config);
+/**
+ * Send a request and hand the stream answering it to the sink as it arrives.
+ * Returns CONNECTION_DONE once the whole stream is in, CONNECTION_CORRUPTED
+ * if it did not match the server's hash, and CONNECTION_FAILED if the
+ * request cannot be sent, the server stopped answering or the sink failed.
+ * The hash is only checked at the end, after the sink has seen the whole
+ * stream.
+ */
+ConnectionState requestStream(Buffer request, int sockfd, struct sockaddr *addr,
+                   socklen_t *addrLen, Config config, Sink sink, void *ctx);
+
+/**
+ * Like requestBytes, but the answer goes straight into a file.  Each packet
+ * is written with pwrite at base + its offset into the stream as it arrives,
+ * so the stream is never held in memory.  Returns the length of the stream,
+ * or -1 if the request could not be sent, writing to the file failed, or the
+ * stream did not match its hash.
+ */
+ssize_t requestToFile(Buffer request, int fd, off_t base, int sockfd,
+                      struct sockaddr *addr, socklen_t *addrLen,
+                      Config config);
+
+/**
+ * Server side of a transfer: wait for a REQ packet, and return its bytes
+ * along with the epoch that the answer must be sent with.  The caller must
+ * free the returned buffer.
+ */
+Buffer receiveRequest(int sockfd, struct sockaddr *restrict fromAddress,
+                      socklen_t *restrict fromAddressLen, uint32_t *epoch,
+                      Config config);
+
+/**
+ * Send a byte array as the answer to the request with the given epoch
+ */
+bool sendBytes(Buffer buf, uint32_t epoch, int sockfd,
+               const struct sockaddr *destAddr, socklen_t destLen,
+               Config config);
+
+/**
+ * Create an array of TRN packets that point into buf
+ * The caller should NOT free the packets, as they point into buf.
+ * The caller should free the packet list, though.
+ */
+int packetize(Buffer buf, Packet **packets);
+
+/**
+ * Send a stream that was cut into packets by packetize.  The packets are
+ * never modified, so many transfers may send the same packet array at once.
+ */
+bool sendPackets(const Packet *packets, int numPackets, uint32_t epoch,
+                 int sockfd, const struct sockaddr *destAddr,
+                 socklen_t destLen, Config config);
+
+/**
+ * Send a datagram pulled from a connection with connectionOutput
+ */
+void sendDatagram(const Datagram *datagram, int sockfd,
+                  const struct sockaddr *destAddr, socklen_t destLen);
+
+/**
+ * Wait up to tv for a datagram and read it into buffer, which must hold
+ * MAX_PACKET_SIZE bytes.  Returns -1 if nothing arrived, 0 if the datagram
+ * was dropped (simulated loss or corruption, or too short to be a packet),
+ * and its length otherwise.
+ */
+ssize_t receiveDatagram(int sockfd, uint8_t *buffer,
+                        struct sockaddr *fromAddress,
+                        socklen_t *fromAddressLen, Config config,
+                        struct timeval tv);
+
+/**
+ * Let the kernel pace the socket by the txTime of the datagrams sent on it.
+ * Returns false if the kernel does not support it.
+ */
+bool enableTxTime(int sockfd);
+
+/**
+ * Check whether two socket addresses are the same host and port
+ */
+bool sameAddress(const struct sockaddr *a, const struct sockaddr *b);
 
 #endif  // LIB_RDTP
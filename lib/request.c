@@ -0,0 +1,155 @@
+#include "request.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Serialize a request.  It is the caller's responsibility to free the buffer.
+ */
+Buffer formatRequest(const Request *const request) {
+  char temp[MAX_REQUEST_PATH + 64];
+  int length = 0;
+
+  switch (request->type) {
+    case REQUEST_SIZE:
+      length = snprintf(temp, sizeof(temp), "SIZE %s", request->path);
+      break;
+    case REQUEST_RANGE:
+      length = snprintf(temp, sizeof(temp), "RANGE %zu %zu %s",
+                        request->offset, request->length, request->path);
+      break;
+    case REQUEST_FILES:
+      length = snprintf(temp, sizeof(temp), "FILES\n%s", request->path);
+      break;
+    case REQUEST_ARCHIVE:
+      length = snprintf(temp, sizeof(temp), "ARCHIVE %s", request->path);
+      break;
+    default:
+      length = snprintf(temp, sizeof(temp), "%s", request->path);
+      break;
+  }
+  assert(0 < length && length < (int)sizeof(temp));
+
+  Buffer buf;
+  buf.data = (uint8_t *)malloc(length);
+  assert(buf.data);
+  memcpy(buf.data, temp, length);
+  buf.length = length;
+  return buf;
+}
+
+/**
+ * Parse a received request.  Returns false if the request is malformed.
+ */
+bool parseRequest(Buffer buf, Request *request) {
+  if (0 == buf.length || MAX_REQUEST_PATH + 64 <= buf.length) {
+    return false;
+  }
+
+  // Work on a terminated copy
+  char temp[MAX_REQUEST_PATH + 64];
+  memcpy(temp, buf.data, buf.length);
+  temp[buf.length] = '\0';
+
+  request->offset = 0;
+  request->length = 0;
+
+  const char *path = temp;
+  int consumed = 0;
+  if (0 == strncmp(temp, "SIZE ", 5)) {
+    request->type = REQUEST_SIZE;
+    path = &temp[5];
+  } else if (0 == strncmp(temp, "RANGE ", 6)) {
+    request->type = REQUEST_RANGE;
+    if (2 != sscanf(temp, "RANGE %zu %zu %n", &request->offset,
+                    &request->length, &consumed) ||
+        0 == consumed) {
+      return false;
+    }
+    path = &temp[consumed];
+  } else if (0 == strncmp(temp, "FILES\n", 6)) {
+    request->type = REQUEST_FILES;
+    path = &temp[6];
+  } else if (0 == strncmp(temp, "ARCHIVE ", 8)) {
+    request->type = REQUEST_ARCHIVE;
+    path = &temp[8];
+  } else {
+    request->type = REQUEST_FILE;
+  }
+
+  if (0 == strlen(path) || MAX_REQUEST_PATH <= strlen(path)) {
+    return false;
+  }
+  strcpy(request->path, path);
+  return true;
+}
+
+void formatFrameHeader(uint8_t *header, FrameStatus status, uint64_t length) {
+  header[0] = status;
+  for (int i = 0; i < 8; i++) {
+    header[1 + i] = (uint8_t)(length >> (56 - 8 * i));
+  }
+}
+
+bool parseFrameHeader(const uint8_t *header, FrameStatus *status,
+                      uint64_t *length) {
+  if (FRAME_FOUND != header[0] && FRAME_MISSING != header[0]) {
+    return false;
+  }
+  *status = (FrameStatus)header[0];
+
+  *length = 0;
+  for (int i = 0; i < 8; i++) {
+    *length = (*length << 8) | header[1 + i];
+  }
+  return true;
+}
+
+size_t formatEntryHeader(uint8_t *header, const char *path, uint64_t length) {
+  size_t pathLength = strlen(path);
+  assert(pathLength < MAX_REQUEST_PATH);
+
+  header[0] = (uint8_t)(pathLength >> 8);
+  header[1] = (uint8_t)pathLength;
+  memcpy(&header[2], path, pathLength);
+  for (int i = 0; i < 8; i++) {
+    header[2 + pathLength + i] = (uint8_t)(length >> (56 - 8 * i));
+  }
+  return 2 + pathLength + 8;
+}
+
+size_t entryHeaderLength(const uint8_t *header) {
+  size_t pathLength = (size_t)header[0] << 8 | header[1];
+  if (0 == pathLength || MAX_REQUEST_PATH <= pathLength) {
+    return 0;
+  }
+  return 2 + pathLength + 8;
+}
+
+bool parseEntryHeader(const uint8_t *header, char *path, uint64_t *length) {
+  size_t pathLength = (size_t)header[0] << 8 | header[1];
+  if (0 == pathLength || MAX_REQUEST_PATH <= pathLength) {
+    return false;
+  }
+  memcpy(path, &header[2], pathLength);
+  path[pathLength] = '\0';
+
+  *length = 0;
+  for (int i = 0; i < 8; i++) {
+    *length = (*length << 8) | header[2 + pathLength + i];
+  }
+
+  // Only ever write below the download directory
+  if ('/' == path[0] || strlen(path) != pathLength) {
+    return false;
+  }
+  for (const char *part = path; part; part = strchr(part, '/')) {
+    part += '/' == *part;
+    if (0 == strncmp(part, "..", 2) && ('/' == part[2] || !part[2])) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,103 @@
+#ifndef LIB_REQUEST
+#define LIB_REQUEST
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+/**
+ * Requests the client can make of the server.  A request travels as the
+ * payload of a single REQ packet, so it must fit in one packet.
+ *
+ * FILE:  "<path>"                        whole file
+ * SIZE:  "SIZE <path>"                   file size, as a decimal string
+ * RANGE: "RANGE <offset> <length> <path>" length bytes starting at offset
+ * FILES: "FILES\n<path>\n<path>..."      many whole files, one frame each
+ * ARCHIVE: "ARCHIVE <path>"              every file under a directory
+ *
+ * For FILES, path holds the newline separated list of paths.
+ */
+typedef enum {
+  REQUEST_FILE,
+  REQUEST_SIZE,
+  REQUEST_RANGE,
+  REQUEST_FILES,
+  REQUEST_ARCHIVE
+} RequestType;
+
+#define MAX_REQUEST_PATH 4096
+
+typedef struct Request {
+  RequestType type;
+  char path[MAX_REQUEST_PATH];
+  size_t offset;
+  size_t length;
+} Request;
+
+/**
+ * Serialize a request.  It is the caller's responsibility to free the buffer.
+ */
+Buffer formatRequest(const Request *const request);
+
+/**
+ * Parse a received request.  Returns false if the request is malformed.
+ */
+bool parseRequest(Buffer buf, Request *request);
+
+/**
+ * The answer to a FILES request is one frame per path, in order.  A frame is
+ * a header followed by the file's contents:
+ *
+ * | 1 byte                       | 8 bytes            | length bytes |
+ * | FRAME_FOUND or FRAME_MISSING | length, big-endian | contents     |
+ */
+#define FRAME_HEADER_LENGTH 9
+
+typedef enum { FRAME_FOUND = 0, FRAME_MISSING = 1 } FrameStatus;
+
+/**
+ * Write a frame header into header, which must hold FRAME_HEADER_LENGTH bytes
+ */
+void formatFrameHeader(uint8_t *header, FrameStatus status, uint64_t length);
+
+/**
+ * Read a frame header.  Returns false if the status is unknown.
+ */
+bool parseFrameHeader(const uint8_t *header, FrameStatus *status,
+                      uint64_t *length);
+
+/**
+ * The answer to an ARCHIVE request is one entry per regular file under the
+ * directory, packed back to back with no regard for packet boundaries:
+ *
+ * | 2 bytes                | pathLength bytes | 8 bytes            | length |
+ * | pathLength, big-endian | path             | length, big-endian | bytes  |
+ *
+ * Paths are relative to the directory, and never hold a ".." component.
+ * If the directory cannot be found, the answer is instead a lone zero
+ * pathLength, which no entry has.
+ */
+#define MAX_ENTRY_HEADER (2 + MAX_REQUEST_PATH + 8)
+
+/**
+ * Write an entry header into header, which must hold MAX_ENTRY_HEADER bytes.
+ * Returns the length of the header.
+ */
+size_t formatEntryHeader(uint8_t *header, const char *path, uint64_t length);
+
+/**
+ * Length of the entry header starting with the 2 bytes given.  Returns 0 if
+ * the path length is empty or too long, in which case the header does not
+ * fit in MAX_ENTRY_HEADER bytes and must be rejected.
+ */
+size_t entryHeaderLength(const uint8_t *header);
+
+/**
+ * Read a whole entry header into path, which must hold MAX_REQUEST_PATH
+ * bytes.  Returns false if the path is empty or unsafe to write to.
+ */
+bool parseEntryHeader(const uint8_t *header, char *path, uint64_t *length);
+
+#endif  // LIB_REQUEST
@@ -1,17 +1,23 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include "hash.h"
 #include "packet.h"
+#include "request.h"
 
 /**
  * This is a test program to test how the packet library works, and to serve
- * as example code.
+ * as example code.  Build it with:
+ *   gcc -std=gnu99 test.c packet.c request.c buffer.c hash.c
  */
 
 bool comparePackets(Packet *a, Packet *b) {
   if(a->isAck != b->isAck) return false;
   if(a->isFin != b->isFin) return false;
+  if(a->isReq != b->isReq) return false;
   if(a->seq != b->seq) return false;
+  if(a->epoch != b->epoch) return false;
   if(a->length != b->length) return false;
 
   for(size_t i=0; i<a->length; i++) {
@@ -42,6 +48,41 @@ void pretendSend(Packet *p) {
   free(buffer);
 }
 
+uint64_t hashPieces(const uint8_t *data, size_t length, size_t piece) {
+  Hasher hasher;
+  hashInit(&hasher, 0);
+  for (size_t done = 0; done < length; done += piece) {
+    hashUpdate(&hasher, data + done, length - done < piece ? length - done
+                                                            : piece);
+  }
+  return hashDigest(&hasher);
+}
+
+uint64_t hashString(const char *s) {
+  return hashPieces((const uint8_t *)s, strlen(s), strlen(s) ? strlen(s) : 1);
+}
+
+/**
+ * Whether an archive entry for path would be unpacked, and where
+ */
+bool entryAccepted(const char *path) {
+  uint8_t header[MAX_ENTRY_HEADER];
+  size_t length = formatEntryHeader(header, path, 1234);
+  size_t headerLength = entryHeaderLength(header);
+  if (!headerLength) {
+    return false;
+  }
+  assert(length == headerLength);
+
+  char parsed[MAX_REQUEST_PATH];
+  uint64_t fileLength;
+  if (!parseEntryHeader(header, parsed, &fileLength)) {
+    return false;
+  }
+  assert(0 == strcmp(parsed, path) && 1234 == fileLength);
+  return true;
+}
+
 int main()
 {
   // TEST PACKET TYPES
@@ -50,7 +91,9 @@ int main()
   Packet trn;
   trn.isAck = false;
   trn.isFin = false;
+  trn.isReq = false;
   trn.seq = 118;
+  trn.epoch = 0xdeadbeef;
   trn.data = (uint8_t*)testData;
   trn.length = 13;
   // Don't need to free 'trn' packet because the data wasn't malloc'd
@@ -62,13 +105,75 @@ int main()
   pretendSend(&ack);
   freePacket(&ack);
 
+  // ACK advertising the receiver's free buffer space
+  uint8_t window[4];
+  Packet windowAck = makeAck(118);
+  setAckWindow(&windowAck, window, 65536);
+  pretendSend(&windowAck);
+  uint32_t bytes;
+  assert(getAckWindow(&windowAck, &bytes) && bytes == 65536);
+
   // FIN
   Packet fin = makeFin();
   pretendSend(&fin);
   freePacket(&fin);
 
+  // FIN carrying the stream hash
+  uint8_t hash[8];
+  Packet hashFin = makeFin();
+  setFinHash(&hashFin, hash, 0x0123456789abcdefULL);
+  pretendSend(&hashFin);
+  uint64_t digest;
+  assert(getFinHash(&hashFin, &digest) && digest == 0x0123456789abcdefULL);
+
   // FINACK
   Packet finAck = makeFinAck();
   pretendSend(&finAck);
   freePacket(&finAck);
+
+  // REQ
+  Packet req = makeReq(42);
+  req.data = (uint8_t*)testData;
+  req.length = 13;
+  pretendSend(&req);
+
+  // Archive entries may only name files below the download directory
+  assert(entryAccepted("a"));
+  assert(entryAccepted("a/b/c.txt"));
+  assert(entryAccepted("..foo"));
+  assert(entryAccepted("a/..b/c.."));
+  assert(!entryAccepted(""));
+  assert(!entryAccepted("/abs"));
+  assert(!entryAccepted(".."));
+  assert(!entryAccepted("../a"));
+  assert(!entryAccepted("a/../b"));
+  assert(!entryAccepted("a/.."));
+
+  // A path length too long for the header buffer is refused from the 2
+  // length bytes alone
+  uint8_t lengthBytes[2] = {(MAX_REQUEST_PATH - 1) >> 8,
+                            (uint8_t)(MAX_REQUEST_PATH - 1)};
+  assert(2 + MAX_REQUEST_PATH - 1 + 8 == entryHeaderLength(lengthBytes));
+  lengthBytes[0] = MAX_REQUEST_PATH >> 8;
+  lengthBytes[1] = (uint8_t)MAX_REQUEST_PATH;
+  assert(0 == entryHeaderLength(lengthBytes));
+  lengthBytes[0] = 0xff;
+  lengthBytes[1] = 0xff;
+  assert(0 == entryHeaderLength(lengthBytes));
+
+  // Stream hash against the published XXH64 vectors, seed 0
+  assert(0xef46db3751d8e999ULL == hashString(""));
+  assert(0xd24ec4f1a98c6e5bULL == hashString("a"));
+  assert(0x44bc2cf5ad770999ULL == hashString("abc"));
+  assert(0x066ed728fceeb3beULL == hashString("message digest"));
+
+  // Fed in pieces that straddle its 32-byte stripes, it hashes the same
+  uint8_t stream[1000];
+  for (size_t i = 0; i < sizeof(stream); i++) {
+    stream[i] = (uint8_t)(i * 31 + 7);
+  }
+  uint64_t whole = hashPieces(stream, sizeof(stream), sizeof(stream));
+  assert(whole == hashPieces(stream, sizeof(stream), 1));
+  assert(whole == hashPieces(stream, sizeof(stream), 7));
+  assert(hashPieces(stream, 40, 40) == hashPieces(stream, 40, 1));
 }
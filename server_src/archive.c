@@ -0,0 +1,369 @@
+#include "archive.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../lib/packet.h"
+#include "../lib/request.h"
+#include "cache.h"
+
+// Full packets gathered before a chunk is queued
+#define PACKER_CHUNK_PACKETS 64
+
+// Packets kept waiting on the connection while an answer is produced
+#define PRODUCE_AHEAD_PACKETS (2 * PACKER_CHUNK_PACKETS)
+
+// Largest file packed along with the other frames of a FILES answer, rather
+// than sent as its own packets after its frame header
+#define SMALL_FRAME_FILE (64 * 1024)
+
+typedef enum ProducerKind {
+  PRODUCE_ARCHIVE,  // entry header and contents of every file under dir
+  PRODUCE_FRAMES,   // frame header and contents of every path
+  PRODUCE_RANGE     // part of the one path
+} ProducerKind;
+
+struct Producer {
+  Connection *conn;
+  Packer packer;
+  ProducerKind kind;
+  char *dir;           // for an archive, what the paths are relative to
+  char **paths;
+  int numPaths;
+  int capacity;
+  int next;            // next file to pack
+  int fd;              // file being packed, -1 between files
+  uint64_t offset;     // where in it to read next
+  uint64_t remaining;  // bytes of it still to pack
+  uint64_t rangeOffset;
+  uint64_t rangeLength;
+};
+
+static size_t chunkSize() {
+  return (size_t)PACKER_CHUNK_PACKETS *
+         (MAX_PACKET_SIZE - PACKET_HEADER_LENGTH);
+}
+
+void packerInit(Packer *packer, Connection *conn) {
+  packer->conn = conn;
+  packer->chunk = NULL;
+  packer->length = 0;
+}
+
+/**
+ * Free space at the end of the current chunk, starting a chunk if needed
+ */
+static uint8_t *packerSpace(Packer *packer, size_t *space) {
+  if (!packer->chunk) {
+    packer->chunk = (uint8_t *)malloc(chunkSize());
+    assert(packer->chunk);
+    packer->length = 0;
+  }
+  *space = chunkSize() - packer->length;
+  return packer->chunk + packer->length;
+}
+
+/**
+ * Count length bytes written into the space, queueing the chunk once full
+ */
+static void packerCommit(Packer *packer, size_t length) {
+  packer->length += length;
+  if (packer->length == chunkSize()) {
+    packerFlush(packer);
+  }
+}
+
+void packerAppend(Packer *packer, const uint8_t *data, size_t length) {
+  while (length) {
+    size_t space;
+    uint8_t *to = packerSpace(packer, &space);
+    size_t piece = length < space ? length : space;
+    memcpy(to, data, piece);
+    packerCommit(packer, piece);
+    data += piece;
+    length -= piece;
+  }
+}
+
+void packerFlush(Packer *packer) {
+  if (!packer->chunk) {
+    return;
+  }
+  connectionSendBuffer(packer->conn, packer->chunk, packer->length, free,
+                       packer->chunk);
+  packer->chunk = NULL;
+  packer->length = 0;
+}
+
+static void addPath(Producer *archive, const char *path) {
+  if (archive->numPaths == archive->capacity) {
+    archive->capacity = archive->capacity ? 2 * archive->capacity : 64;
+    archive->paths = (char **)realloc(archive->paths,
+                                      archive->capacity * sizeof(char *));
+    assert(archive->paths);
+  }
+  archive->paths[archive->numPaths++] = strdup(path);
+}
+
+/**
+ * Add the regular files under dir/prefix, recursing into directories.
+ * Symbolic links are not followed.
+ */
+static void listFiles(Producer *archive, const char *prefix) {
+  char path[MAX_REQUEST_PATH];
+  snprintf(path, sizeof(path), "%s/%s", archive->dir, prefix);
+  DIR *dir = opendir(path);
+  if (!dir) {
+    printf("Error: Cannot list %s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, "..")) {
+      continue;
+    }
+
+    char relative[MAX_REQUEST_PATH];
+    int length = snprintf(relative, sizeof(relative), "%s%s%s", prefix,
+                          prefix[0] ? "/" : "", entry->d_name);
+    snprintf(path, sizeof(path), "%s/%s", archive->dir, relative);
+    if ((int)sizeof(relative) <= length ||
+        strlen(archive->dir) + 1 + length >= sizeof(path)) {
+      printf("Error: Path %s/%s is too long\n", prefix, entry->d_name);
+      continue;
+    }
+
+    struct stat info;
+    if (lstat(path, &info) == -1) {
+      continue;
+    }
+    if (S_ISDIR(info.st_mode)) {
+      listFiles(archive, relative);
+    } else if (S_ISREG(info.st_mode)) {
+      addPath(archive, relative);
+    }
+  }
+  closedir(dir);
+}
+
+static Producer *makeProducer(ProducerKind kind, Connection *conn) {
+  Producer *producer = (Producer *)calloc(1, sizeof(Producer));
+  assert(producer);
+  producer->conn = conn;
+  producer->kind = kind;
+  packerInit(&producer->packer, conn);
+  producer->fd = -1;
+  return producer;
+}
+
+Producer *openArchive(const char *dir, Connection *conn) {
+  struct stat info;
+  if (stat(dir, &info) == -1 || !S_ISDIR(info.st_mode)) {
+    printf("Error: Directory %s cannot be found\n", dir);
+    uint8_t missing[2] = {0, 0};
+    connectionWrite(conn, missing, sizeof(missing));
+    return NULL;
+  }
+
+  Producer *archive = makeProducer(PRODUCE_ARCHIVE, conn);
+  archive->dir = strdup(dir);
+  listFiles(archive, "");
+
+  printf("Archiving %d files under %s\n", archive->numPaths, dir);
+  return archive;
+}
+
+Producer *openFiles(const char *paths, Connection *conn) {
+  Producer *files = makeProducer(PRODUCE_FRAMES, conn);
+  char list[MAX_REQUEST_PATH];
+  snprintf(list, sizeof(list), "%s", paths);
+  char *save;
+  for (char *path = strtok_r(list, "\n", &save); path;
+       path = strtok_r(NULL, "\n", &save)) {
+    addPath(files, path);
+  }
+  return files;
+}
+
+Producer *openRange(const char *path, uint64_t offset, uint64_t length,
+                    Connection *conn) {
+  Producer *range = makeProducer(PRODUCE_RANGE, conn);
+  addPath(range, path);
+  range->rangeOffset = offset;
+  range->rangeLength = length;
+  return range;
+}
+
+/**
+ * Start packing the next file of an archive.  Returns false if it cannot be
+ * read, in which case it is left out of the archive.
+ */
+static bool openEntry(Producer *archive) {
+  const char *relative = archive->paths[archive->next++];
+  char path[MAX_REQUEST_PATH];
+  snprintf(path, sizeof(path), "%s/%s", archive->dir, relative);
+
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd == -1 || fstat(fd, &info) == -1) {
+    printf("Error: File %s cannot be read\n", path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  uint8_t header[MAX_ENTRY_HEADER];
+  size_t length = formatEntryHeader(header, relative, info.st_size);
+  packerAppend(&archive->packer, header, length);
+
+  archive->fd = fd;
+  archive->offset = 0;
+  archive->remaining = info.st_size;
+  return true;
+}
+
+/**
+ * Start the frame of the next file of a FILES answer.  A file that cannot
+ * be read gets a frame saying so.  A cached file is sent from the cache;
+ * small ones are packed along with the frames around them.
+ */
+static bool openFrame(Producer *files) {
+  const char *path = files->paths[files->next++];
+  uint8_t header[FRAME_HEADER_LENGTH];
+
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd == -1 || fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+    printf("Error: File %s cannot be found\n", path);
+    if (fd != -1) {
+      close(fd);
+    }
+    formatFrameHeader(header, FRAME_MISSING, 0);
+    packerAppend(&files->packer, header, sizeof(header));
+    return false;
+  }
+
+  formatFrameHeader(header, FRAME_FOUND, info.st_size);
+  packerAppend(&files->packer, header, sizeof(header));
+
+  CacheEntry *entry = cacheAcquire(path);
+  if (entry && entry->file.length == (size_t)info.st_size) {
+    close(fd);
+    if (entry->file.length <= SMALL_FRAME_FILE) {
+      packerAppend(&files->packer, entry->file.data, entry->file.length);
+      cacheRelease(entry);
+    } else {
+      // Send the shared, already packetized file right after its header
+      packerFlush(&files->packer);
+      connectionSendPackets(files->conn, entry->packets, entry->numPackets,
+                            releaseEntry, entry);
+    }
+    return true;
+  }
+  cacheRelease(entry);
+
+  files->fd = fd;
+  files->offset = 0;
+  files->remaining = info.st_size;
+  return true;
+}
+
+/**
+ * Start reading the range to send.  Returns false if the file cannot be
+ * read, in which case the stream is left empty.
+ */
+static bool openPart(Producer *range) {
+  const char *path = range->paths[range->next++];
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    printf("Error: File %s cannot be read\n", path);
+    return false;
+  }
+
+  range->fd = fd;
+  range->offset = range->rangeOffset;
+  range->remaining = range->rangeLength;
+  return true;
+}
+
+/**
+ * Read the file being packed straight into the packer, as far as one chunk
+ */
+static void packEntry(Producer *archive) {
+  size_t space;
+  uint8_t *to = packerSpace(&archive->packer, &space);
+  size_t length = archive->remaining < space ? archive->remaining : space;
+
+  ssize_t bytesRead = pread(archive->fd, to, length, archive->offset);
+  if (bytesRead == -1 && errno == EINTR) {
+    return;
+  }
+  if (bytesRead <= 0 && archive->kind == PRODUCE_RANGE) {
+    // The file shrank; the stream ends short
+    close(archive->fd);
+    archive->fd = -1;
+    return;
+  }
+  if (bytesRead <= 0) {
+    // The file shrank since its header went out; keep the framing intact
+    memset(to, 0, length);
+    bytesRead = length;
+  }
+
+  packerCommit(&archive->packer, bytesRead);
+  archive->offset += bytesRead;
+  archive->remaining -= bytesRead;
+
+  if (!archive->remaining) {
+    close(archive->fd);
+    archive->fd = -1;
+  }
+}
+
+bool producerFill(Producer *producer) {
+  while (connectionBacklog(producer->conn) < PRODUCE_AHEAD_PACKETS) {
+    if (producer->fd == -1) {
+      if (producer->next == producer->numPaths) {
+        packerFlush(&producer->packer);
+        connectionFinish(producer->conn);
+        return true;
+      }
+      if (producer->kind == PRODUCE_ARCHIVE) {
+        openEntry(producer);
+      } else if (producer->kind == PRODUCE_FRAMES) {
+        openFrame(producer);
+      } else {
+        openPart(producer);
+      }
+      continue;
+    }
+    packEntry(producer);
+  }
+  return false;
+}
+
+void freeProducer(Producer *producer) {
+  if (!producer) {
+    return;
+  }
+
+  if (producer->fd != -1) {
+    close(producer->fd);
+  }
+  free(producer->packer.chunk);
+  for (int i = 0; i < producer->numPaths; i++) {
+    free(producer->paths[i]);
+  }
+  free(producer->paths);
+  free(producer->dir);
+  free(producer);
+}
@@ -0,0 +1,69 @@
+#ifndef SERVER_ARCHIVE
+#define SERVER_ARCHIVE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../lib/connection.h"
+
+/**
+ * Packs small pieces of a stream into full packets.  Bytes appended are
+ * copied into a chunk that is queued on the connection once it holds a
+ * whole number of full packets, so many small files share packets instead
+ * of each ending in a mostly empty one.
+ */
+typedef struct Packer {
+  Connection *conn;
+  uint8_t *chunk;
+  size_t length;
+} Packer;
+
+void packerInit(Packer *packer, Connection *conn);
+
+/**
+ * Append a copy of data to the stream
+ */
+void packerAppend(Packer *packer, const uint8_t *data, size_t length);
+
+/**
+ * Queue whatever was appended, even if it does not fill a packet
+ */
+void packerFlush(Packer *packer);
+
+/**
+ * Answer to a request, produced as the stream goes out, so that a large
+ * file or directory is never held in memory at once and no more than a
+ * chunk is read from disk at a time.
+ */
+typedef struct Producer Producer;
+
+/**
+ * Answer to an ARCHIVE request: the regular files under dir.  Returns NULL
+ * if dir is not a directory, after queueing the zero path length that tells
+ * the client so.
+ */
+Producer *openArchive(const char *dir, Connection *conn);
+
+/**
+ * Answer to a FILES request: one frame for each of the newline separated
+ * paths
+ */
+Producer *openFiles(const char *paths, Connection *conn);
+
+/**
+ * length bytes of the file at path, starting at offset
+ */
+Producer *openRange(const char *path, uint64_t offset, uint64_t length,
+                    Connection *conn);
+
+/**
+ * Queue more of the answer on the connection while few packets are waiting
+ * to be sent.  Returns true once the whole answer is queued and the stream
+ * is finished.
+ */
+bool producerFill(Producer *producer);
+
+void freeProducer(Producer *producer);
+
+#endif  // SERVER_ARCHIVE
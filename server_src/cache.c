@@ -0,0 +1,273 @@
+#include "cache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_BUCKETS 256
+
+// Largest file read in whole as soon as it is asked for
+#define CACHE_LOAD_AT_ONCE (64 * 1024)
+
+static CacheEntry *buckets[CACHE_BUCKETS];
+static CacheEntry *lruHead = NULL;
+static CacheEntry *lruTail = NULL;
+static size_t budget = 0;
+static size_t used = 0;
+static CacheEntry *loads = NULL;  // entries still being read in
+
+/**
+ * Bytes an entry for a file of size bytes counts against the budget
+ */
+static size_t entrySize(size_t size) {
+  size_t numPackets = size / (MAX_PACKET_SIZE - PACKET_HEADER_LENGTH) + 1;
+  return size + numPackets * sizeof(Packet);
+}
+
+static unsigned int hashPath(const char *path) {
+  unsigned int hash = 5381;
+  for (const char *c = path; *c; c++) {
+    hash = hash * 33 + (unsigned char)*c;
+  }
+  return hash % CACHE_BUCKETS;
+}
+
+static void freeEntry(CacheEntry *entry) {
+  if (entry->fd != -1) {
+    close(entry->fd);
+  }
+  free(entry->path);
+  freeBuffer(&entry->file);
+  free(entry->packets);
+  free(entry);
+}
+
+static void unlinkLru(CacheEntry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    lruHead = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    lruTail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void pushLru(CacheEntry *entry) {
+  entry->prev = NULL;
+  entry->next = lruHead;
+  if (lruHead) {
+    lruHead->prev = entry;
+  }
+  lruHead = entry;
+  if (!lruTail) {
+    lruTail = entry;
+  }
+}
+
+static void unlinkLoad(CacheEntry *entry) {
+  CacheEntry **load = &loads;
+  while (*load != entry) {
+    load = &(*load)->nextLoad;
+  }
+  *load = entry->nextLoad;
+  entry->nextLoad = NULL;
+}
+
+/**
+ * Take an entry out of the cache.  It is freed now if nobody holds it,
+ * otherwise by the last cacheRelease.
+ */
+static void evict(CacheEntry *entry) {
+  CacheEntry **link = &buckets[hashPath(entry->path)];
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  unlinkLru(entry);
+  used -= entry->charged;
+
+  if (entry->fd != -1) {
+    unlinkLoad(entry);
+  }
+
+  entry->stale = true;
+  if (0 == entry->refs) {
+    freeEntry(entry);
+  }
+}
+
+/**
+ * The entry is all read in; cut it into packets.  Returns false if the file
+ * changed while it was read, in which case the entry is evicted.
+ */
+static bool finishLoad(CacheEntry *entry) {
+  struct stat info;
+  bool changed = fstat(entry->fd, &info) == -1 ||
+                 entry->mtime.tv_sec != info.st_mtim.tv_sec ||
+                 entry->mtime.tv_nsec != info.st_mtim.tv_nsec;
+  if (changed) {
+    evict(entry);
+    return false;
+  }
+
+  unlinkLoad(entry);
+  close(entry->fd);
+  entry->fd = -1;
+  entry->numPackets = packetize(entry->file, &entry->packets);
+  return true;
+}
+
+/**
+ * Read up to maxBytes more of a loading entry, finishing it once it is all
+ * in.  Returns the number of bytes read, or -1 if the entry was evicted
+ * because the file shrank, changed or cannot be read.
+ */
+static ssize_t loadPiece(CacheEntry *entry, size_t maxBytes) {
+  size_t piece = entry->size - entry->file.length;
+  piece = piece < maxBytes ? piece : maxBytes;
+
+  ssize_t bytesRead;
+  do {
+    bytesRead = pread(entry->fd, entry->file.data + entry->file.length, piece,
+                      entry->file.length);
+  } while (bytesRead == -1 && errno == EINTR);
+  if (bytesRead <= 0) {
+    evict(entry);
+    return -1;
+  }
+
+  entry->file.length += bytesRead;
+  if (entry->file.length == entry->size && !finishLoad(entry)) {
+    return -1;
+  }
+  return bytesRead;
+}
+
+void cacheInit(size_t newBudget) {
+  budget = newBudget;
+  while (lruTail && budget < used) {
+    evict(lruTail);
+  }
+}
+
+CacheEntry *cacheAcquire(const char *path) {
+  struct stat info;
+  if (stat(path, &info) == -1 || !S_ISREG(info.st_mode) ||
+      0 == info.st_size) {
+    return NULL;
+  }
+
+  unsigned int bucket = hashPath(path);
+  for (CacheEntry *entry = buckets[bucket]; entry; entry = entry->chain) {
+    if (0 != strcmp(entry->path, path)) {
+      continue;
+    }
+
+    if (entry->mtime.tv_sec == info.st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == info.st_mtim.tv_nsec &&
+        entry->size == (size_t)info.st_size) {
+      if (entry->fd != -1) {
+        // Still being read in
+        return NULL;
+      }
+
+      // Hit
+      unlinkLru(entry);
+      pushLru(entry);
+      entry->refs++;
+      return entry;
+    }
+
+    // The file changed on disk
+    evict(entry);
+    break;
+  }
+
+  // Miss, load the file if it can fit
+  size_t size = entrySize(info.st_size);
+  if (budget < size) {
+    return NULL;
+  }
+
+  CacheEntry *entry = (CacheEntry *)calloc(1, sizeof(CacheEntry));
+  assert(entry);
+  entry->fd = open(path, O_RDONLY);
+  entry->file.data = (uint8_t *)malloc(info.st_size);
+  if (entry->fd == -1 || !entry->file.data) {
+    freeEntry(entry);
+    return NULL;
+  }
+  entry->path = strdup(path);
+  assert(entry->path);
+  entry->mtime = info.st_mtim;
+  entry->size = info.st_size;
+  entry->charged = size;
+
+  // Make room
+  while (lruTail && budget < used + size) {
+    evict(lruTail);
+  }
+
+  entry->chain = buckets[bucket];
+  buckets[bucket] = entry;
+  pushLru(entry);
+  used += size;
+
+  if (CACHE_LOAD_AT_ONCE < entry->size) {
+    // Leave it for cacheFill
+    CacheEntry **load = &loads;
+    while (*load) {
+      load = &(*load)->nextLoad;
+    }
+    *load = entry;
+    return NULL;
+  }
+
+  // Small enough to read in right away
+  entry->nextLoad = loads;
+  loads = entry;
+  while (entry->fd != -1) {
+    if (loadPiece(entry, entry->size) == -1) {
+      return NULL;
+    }
+  }
+  entry->refs = 1;
+  return entry;
+}
+
+bool cacheFill(size_t maxBytes) {
+  while (loads && maxBytes) {
+    ssize_t bytesRead = loadPiece(loads, maxBytes);
+    if (bytesRead > 0) {
+      maxBytes -= bytesRead;
+    }
+  }
+  return NULL != loads;
+}
+
+void releaseEntry(void *entry) {
+  cacheRelease((CacheEntry *)entry);
+}
+
+void cacheRelease(CacheEntry *entry) {
+  if (!entry) {
+    return;
+  }
+
+  assert(0 < entry->refs);
+  entry->refs--;
+  if (entry->stale && 0 == entry->refs) {
+    freeEntry(entry);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef SERVER_CACHE
+#define SERVER_CACHE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "../lib/rdtp.h"
+
+/**
+ * In-process LRU cache of hot files.  Each entry keeps the file's contents
+ * along with the TRN packets cut from them, so a cached file can be sent
+ * without touching the disk, allocating, or packetizing.  Entries are keyed
+ * by path and modification time, so a file that changes on disk is reloaded.
+ *
+ * The packets are read-only and shared by every transfer of the file.  An
+ * entry stays alive while it is acquired, even if it is evicted meanwhile.
+ *
+ * Only small files are read in when first asked for.  Larger ones are read a
+ * piece at a time by cacheFill, so that loading one never holds up the
+ * server's loop, and can be acquired once they are in.
+ */
+typedef struct CacheEntry {
+  char *path;
+  struct timespec mtime;
+  Buffer file;               // bytes read so far, while loading
+  Packet *packets;
+  int numPackets;
+  size_t charged;            // bytes counted against the budget
+  int fd;                    // file being read in, -1 once loaded
+  size_t size;               // length of the file
+  struct CacheEntry *nextLoad;  // entries still loading, oldest first
+  int refs;                  // acquisitions not yet released
+  bool stale;                // evicted, free once released
+  struct CacheEntry *prev;   // LRU list, most recently used first
+  struct CacheEntry *next;
+  struct CacheEntry *chain;  // hash bucket chain
+} CacheEntry;
+
+/**
+ * Set the cache's memory budget in bytes.  A budget of 0 disables the cache.
+ */
+void cacheInit(size_t budget);
+
+/**
+ * Look up a file, loading it into the cache on a miss.  Returns NULL if the
+ * file is not in the cache yet, cannot be read or does not fit in the
+ * budget, in which case the caller should read it the uncached way.  Every
+ * entry returned must be released.
+ */
+CacheEntry *cacheAcquire(const char *path);
+
+void cacheRelease(CacheEntry *entry);
+
+/**
+ * cacheRelease, for connectionSendPackets to call
+ */
+void releaseEntry(void *entry);
+
+/**
+ * Read up to maxBytes more of the files being loaded.  Returns true if any
+ * are left to load.
+ */
+bool cacheFill(size_t maxBytes);
+
+#endif  // SERVER_CACHE
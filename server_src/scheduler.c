@@ -0,0 +1,279 @@
+#include "scheduler.h"
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/pacer.h"
+#include "../lib/rdtp.h"
+
+#define CLIENT_BUCKETS 64
+
+// Bytes a connection is credited per turn
+#define QUANTUM MAX_PACKET_SIZE
+
+// Datagrams sent per run, before the server goes back to reading ACKs
+#define SCHEDULER_BATCH 64
+
+// Packets a cap lets out back to back after an idle spell
+#define CAP_BURST_PACKETS 4
+
+// Bytes a transfer sends ahead of the round robin before it joins it
+#define SPARSE_BYTES (64 * 1024)
+
+struct SchedulerClient {
+  struct sockaddr_storage addr;  // the host; the port is ignored
+  Pacer pacer;
+  int entries;
+  SchedulerClient *chain;        // hash bucket chain
+};
+
+static SchedulerClient *clients[CLIENT_BUCKETS];
+static SchedulerEntry *sparse = NULL;  // young transfers, sent first
+static SchedulerEntry *cursor = NULL;  // next entry of the ring to take its turn
+static int ringEntries = 0;
+static double clientRate = 0;
+static Pacer global;
+
+/**
+ * The host part of an address, and its length
+ */
+static const uint8_t *hostBytes(const struct sockaddr *addr, size_t *length) {
+  if (addr->sa_family == AF_INET6) {
+    *length = sizeof(struct in6_addr);
+    return (const uint8_t *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+  }
+  *length = sizeof(struct in_addr);
+  return (const uint8_t *)&((const struct sockaddr_in *)addr)->sin_addr;
+}
+
+static bool sameHost(const struct sockaddr *a, const struct sockaddr *b) {
+  size_t lengthA, lengthB;
+  const uint8_t *hostA = hostBytes(a, &lengthA);
+  const uint8_t *hostB = hostBytes(b, &lengthB);
+  return a->sa_family == b->sa_family && lengthA == lengthB &&
+         0 == memcmp(hostA, hostB, lengthA);
+}
+
+static unsigned int hashHost(const struct sockaddr *addr) {
+  size_t length;
+  const uint8_t *host = hostBytes(addr, &length);
+  unsigned int hash = 5381;
+  for (size_t i = 0; i < length; i++) {
+    hash = hash * 33 + host[i];
+  }
+  return hash % CLIENT_BUCKETS;
+}
+
+void schedulerInit(double perClient, double globalRate, uint64_t now) {
+  clientRate = perClient;
+  pacerInit(&global, globalRate, CAP_BURST_PACKETS * MAX_PACKET_SIZE, now);
+}
+
+static SchedulerClient *acquireClient(const struct sockaddr *addr,
+                                      socklen_t addrLen, uint64_t now) {
+  unsigned int bucket = hashHost(addr);
+  SchedulerClient *client = clients[bucket];
+  while (client && !sameHost((struct sockaddr *)&client->addr, addr)) {
+    client = client->chain;
+  }
+
+  if (!client) {
+    client = (SchedulerClient *)calloc(1, sizeof(SchedulerClient));
+    assert(client);
+    memcpy(&client->addr, addr, addrLen);
+    pacerInit(&client->pacer, clientRate, CAP_BURST_PACKETS * MAX_PACKET_SIZE,
+              now);
+    client->chain = clients[bucket];
+    clients[bucket] = client;
+  }
+  client->entries++;
+  return client;
+}
+
+static void releaseClient(SchedulerClient *client) {
+  if (--client->entries) {
+    return;
+  }
+
+  SchedulerClient **link =
+      &clients[hashHost((struct sockaddr *)&client->addr)];
+  while (*link != client) {
+    link = &(*link)->chain;
+  }
+  *link = client->chain;
+  free(client);
+}
+
+void schedulerAdd(SchedulerEntry *entry, Connection *conn,
+                  const struct sockaddr *addr, socklen_t addrLen,
+                  uint64_t now) {
+  entry->conn = conn;
+  entry->addr = addr;
+  entry->addrLen = addrLen;
+  entry->client = acquireClient(addr, addrLen, now);
+  entry->deficit = 0;
+  entry->sent = 0;
+  entry->sparse = true;
+
+  entry->prev = NULL;
+  entry->next = sparse;
+  if (sparse) {
+    sparse->prev = entry;
+  }
+  sparse = entry;
+}
+
+static void leaveSparse(SchedulerEntry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    sparse = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  }
+  entry->sparse = false;
+}
+
+/**
+ * Join the ring just before the cursor, so the newcomer's turn comes at the
+ * end of the current round
+ */
+static void joinRing(SchedulerEntry *entry) {
+  if (cursor) {
+    entry->next = cursor;
+    entry->prev = cursor->prev;
+    cursor->prev->next = entry;
+    cursor->prev = entry;
+  } else {
+    entry->next = entry;
+    entry->prev = entry;
+    cursor = entry;
+  }
+  ringEntries++;
+}
+
+void schedulerRemove(SchedulerEntry *entry) {
+  if (entry->sparse) {
+    leaveSparse(entry);
+  } else {
+    if (entry->next == entry) {
+      cursor = NULL;
+    } else {
+      entry->prev->next = entry->next;
+      entry->next->prev = entry->prev;
+      if (cursor == entry) {
+        cursor = entry->next;
+      }
+    }
+    ringEntries--;
+  }
+  releaseClient(entry->client);
+}
+
+/**
+ * Nanoseconds until the caps let a full packet go to the entry's client
+ */
+static uint64_t capDelay(SchedulerEntry *entry, uint64_t now) {
+  uint64_t wait = pacerDelay(&global, MAX_PACKET_SIZE, now);
+  uint64_t clientWait = pacerDelay(&entry->client->pacer, MAX_PACKET_SIZE,
+                                   now);
+  return wait > clientWait ? wait : clientWait;
+}
+
+/**
+ * Send the entry's next datagram if the caps allow.  Returns its length, 0 if
+ * the connection has nothing to send, or -1 if a cap holds it back, in which
+ * case blockedUntil is moved up to when the cap lifts.
+ */
+static long sendOne(SchedulerEntry *entry, int sockfd, uint64_t now,
+                    uint64_t *blockedUntil) {
+  uint64_t wait = capDelay(entry, now);
+  if (wait) {
+    if (now + wait < *blockedUntil) {
+      *blockedUntil = now + wait;
+    }
+    return -1;
+  }
+
+  Datagram datagram;
+  if (!connectionOutput(entry->conn, now, &datagram)) {
+    return 0;
+  }
+  size_t bytes = 0;
+  for (int i = 0; i < datagram.iovlen; i++) {
+    bytes += datagram.iov[i].iov_len;
+  }
+  sendDatagram(&datagram, sockfd, entry->addr, entry->addrLen);
+  pacerSchedule(&global, bytes, now);
+  pacerSchedule(&entry->client->pacer, bytes, now);
+  entry->sent += bytes;
+  return bytes;
+}
+
+uint64_t schedulerRun(int sockfd, uint64_t now) {
+  uint64_t blockedUntil = UINT64_MAX;
+  int sent = 0;
+
+  // Young transfers send all they have first, so a small request is not
+  // kept waiting a round behind every bulk transfer at each step
+  SchedulerEntry *entry = sparse;
+  while (entry) {
+    SchedulerEntry *next = entry->next;
+    while (entry->sent < SPARSE_BYTES) {
+      if (SCHEDULER_BATCH == sent) {
+        return now;
+      }
+      if (0 >= sendOne(entry, sockfd, now, &blockedUntil)) {
+        break;
+      }
+      sent++;
+    }
+    if (SPARSE_BYTES <= entry->sent) {
+      leaveSparse(entry);
+      joinRing(entry);
+    }
+    entry = next;
+  }
+
+  int idleTurns = 0;  // turns in a row that sent nothing
+  while (cursor && idleTurns < ringEntries) {
+    entry = cursor;
+    cursor = cursor->next;
+    entry->deficit += QUANTUM;
+
+    bool sentAny = false;
+    while (0 < entry->deficit) {
+      if (SCHEDULER_BATCH == sent) {
+        // Come back to this entry first
+        cursor = entry;
+        entry->deficit -= QUANTUM;
+        return now;
+      }
+
+      long bytes = sendOne(entry, sockfd, now, &blockedUntil);
+      if (0 > bytes) {
+        // Credit does not pile up while capped
+        if (QUANTUM < entry->deficit) {
+          entry->deficit = QUANTUM;
+        }
+        break;
+      }
+      if (0 == bytes) {
+        // An idle connection keeps no credit
+        entry->deficit = 0;
+        break;
+      }
+
+      entry->deficit -= bytes;
+      sent++;
+      sentAny = true;
+    }
+    idleTurns = sentAny ? 0 : idleTurns + 1;
+  }
+
+  return blockedUntil;
+}
@@ -0,0 +1,57 @@
+#ifndef SERVER_SCHEDULER
+#define SERVER_SCHEDULER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "../lib/connection.h"
+
+/**
+ * Transmit scheduler shared by every transfer of the server.  Connections
+ * take turns by deficit round robin: each turn credits a connection with a
+ * quantum of bytes, and it sends while it has credit, so every connection
+ * with something to send gets an equal share of bytes however large its
+ * window.  Transfers that have sent little so far skip the queue, so small
+ * requests are answered quickly however many bulk transfers are running.
+ *
+ * Optional token buckets cap the rate of all transfers together, and of all
+ * transfers to the same client host.
+ */
+typedef struct SchedulerClient SchedulerClient;
+
+typedef struct SchedulerEntry {
+  Connection *conn;
+  const struct sockaddr *addr;
+  socklen_t addrLen;
+  SchedulerClient *client;
+  long deficit;                  // bytes the connection may still send
+  size_t sent;                   // bytes sent in all
+  bool sparse;                   // still young, not yet in the ring
+  struct SchedulerEntry *prev;   // young list, or round robin ring
+  struct SchedulerEntry *next;
+} SchedulerEntry;
+
+/**
+ * Set the caps in bytes/sec, 0 for none
+ */
+void schedulerInit(double clientRate, double globalRate, uint64_t now);
+
+/**
+ * Give a connection its turns.  addr must outlive the entry.
+ */
+void schedulerAdd(SchedulerEntry *entry, Connection *conn,
+                  const struct sockaddr *addr, socklen_t addrLen,
+                  uint64_t now);
+
+void schedulerRemove(SchedulerEntry *entry);
+
+/**
+ * Send one batch of datagrams, taking turns between connections.  Returns
+ * when the scheduler should run again: now if the batch filled up, when a
+ * rate cap next lets a blocked connection send, or UINT64_MAX if nothing is
+ * waiting to go.
+ */
+uint64_t schedulerRun(int sockfd, uint64_t now);
+
+#endif  // SERVER_SCHEDULER
@@ -9,8 +9,144 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <assert.h>
 
+#include "../lib/connection.h"
+#include "../lib/pacer.h"
+#include "../lib/profile.h"
 #include "../lib/rdtp.h"
+#include "../lib/request.h"
+#include "archive.h"
+#include "cache.h"
+#include "scheduler.h"
+
+// Number of served requests remembered to drop duplicates
+#define RECENT_EPOCHS 256
+
+// Hash buckets for the transfers in progress
+#define TRANSFER_BUCKETS 256
+
+// Longest wait for a packet when no transfer has a timer running
+#define IDLE_WAIT_SEC 1
+
+// Most bytes of files read into the cache per turn of the loop
+#define CACHE_FILL_BYTES (1024 * 1024)
+
+/**
+ * A transfer in progress, found by the epoch of its request
+ */
+typedef struct Transfer {
+  Connection *conn;
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  Producer *producer;      // answer still being produced, if any
+  SchedulerEntry turn;     // its place in the transmit scheduler
+  struct Transfer *chain;  // hash bucket chain
+} Transfer;
+
+static Transfer *transfers[TRANSFER_BUCKETS];
+
+Transfer *findTransfer(uint32_t epoch)
+{
+  Transfer *transfer = transfers[epoch % TRANSFER_BUCKETS];
+  while (transfer && connectionEpoch(transfer->conn) != epoch) {
+    transfer = transfer->chain;
+  }
+  return transfer;
+}
+
+/**
+ * Queue the answer to one request from a client on its connection, from the
+ * cache entry for the file if there is one.  The entry is released once the
+ * connection is done with it.  Nothing is queued on errors, so the client
+ * gets an empty stream.  Anything not in the cache is only set up here, and
+ * read from disk as the transfer goes.
+ */
+void serveRequest(const Request *request, CacheEntry *entry,
+                  Transfer *transfer)
+{
+  Connection *conn = transfer->conn;
+  if (!request) {
+    printf("Error: Malformed request\n");
+    return;
+  }
+
+  if (request->type == REQUEST_ARCHIVE) {
+    transfer->producer = openArchive(request->path, conn);
+    return;
+  }
+
+  if (request->type == REQUEST_FILES) {
+    printf("Client asked for files:\n%s\n", request->path);
+    transfer->producer = openFiles(request->path, conn);
+    return;
+  }
+
+  printf("Client asked for file: %s\n", request->path);
+
+  struct stat info;
+  if (stat(request->path, &info) == -1 || !S_ISREG(info.st_mode)) {
+    printf("Error: File %s cannot be found\n", request->path);
+    cacheRelease(entry);
+    return;
+  }
+  size_t fileSize = info.st_size;
+
+  if (request->type == REQUEST_SIZE) {
+    char sizeString[32];
+    int length = snprintf(sizeString, sizeof(sizeString), "%zu", fileSize);
+    connectionWrite(conn, (uint8_t *)sizeString, length);
+    return;
+  }
+
+  size_t offset = 0;
+  size_t length = fileSize;
+  if (request->type == REQUEST_RANGE) {
+    if (fileSize < request->offset ||
+        fileSize - request->offset < request->length) {
+      printf("Error: Range %zu+%zu is outside of %s\n", request->offset,
+             request->length, request->path);
+      cacheRelease(entry);
+      return;
+    }
+    offset = request->offset;
+    length = request->length;
+  }
+
+  if (entry) {
+    printf("Serving %s from cache\n", request->path);
+    if (request->type == REQUEST_FILE) {
+      // Send the shared, already packetized file
+      connectionSendPackets(conn, entry->packets, entry->numPackets,
+                            releaseEntry, entry);
+    } else {
+      connectionSendBuffer(conn, entry->file.data + offset, length,
+                           releaseEntry, entry);
+    }
+    return;
+  }
+
+  transfer->producer = openRange(request->path, offset, length, conn);
+}
+
+/**
+ * Report where the time of the transfers just finished went, and add their
+ * folded stacks to the profile
+ */
+void reportProfile(const char *path)
+{
+  profileReport(stderr);
+
+  FILE *folded = fopen(path, "a");
+  if (!folded) {
+    printf("Error: File %s cannot be written!\n", path);
+    return;
+  }
+  profileWriteFolded(folded, "server");
+  fclose(folded);
+}
 
 int main(int argc, char *argv[])
 {
@@ -20,13 +156,59 @@ int main(int argc, char *argv[])
   struct sockaddr_storage their_addr;
   socklen_t addr_len;
 
+  long cacheMegabytes = 64;
+
   srand(time(NULL));
 
-  if (argc != 2 && argc != 5 && argc != 7) {
-    fprintf(stderr,"usage: server <port> optional: <corruption> <packet loss> <CWnd> (<timeout_sec> <timeout_usec>)\n");
+  double pacingRate = 0.0;
+  bool txTime = false;
+  int dupAckThreshold = makeConfig().dupAckThreshold;
+  double clientCap = 0.0;
+  double globalCap = 0.0;
+  const char *profilePath = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:p:Td:r:g:P:")) != -1) {
+    switch (opt) {
+      case 'c':
+        cacheMegabytes = atol(optarg);
+        break;
+      case 'p':
+        pacingRate = atof(optarg);
+        break;
+      case 'T':
+        txTime = true;
+        break;
+      case 'd':
+        dupAckThreshold = atoi(optarg);
+        break;
+      case 'r':
+        clientCap = atof(optarg);
+        break;
+      case 'g':
+        globalCap = atof(optarg);
+        break;
+      case 'P':
+        profilePath = optarg;
+        break;
+      default:
+        cacheMegabytes = -1;
+        break;
+    }
+  }
+  // Leave the positional arguments where they have always been
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if ((argc != 2 && argc != 5 && argc != 7) || cacheMegabytes < 0) {
+    fprintf(stderr,"usage: server [-c <cache MB>] [-p <pacing bytes/sec>] [-T] [-d <dup ACKs>] [-r <bytes/sec per client>] [-g <bytes/sec in all>] [-P <folded profile>] <port> optional: <corruption> <packet loss> <CWnd> (<timeout_sec> <timeout_usec>)\n");
     exit(1);
   }
 
+  cacheInit((size_t)cacheMegabytes * 1024 * 1024);
+  schedulerInit(clientCap, globalCap, monotonicNanos());
+  profileEnable(profilePath != NULL);
+
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_UNSPEC; // set to AF_INET to force IPv4
   hints.ai_socktype = SOCK_DGRAM;
@@ -63,9 +245,7 @@ int main(int argc, char *argv[])
 
   printf("server: waiting to recvfrom...\n");
 
-  addr_len = sizeof their_addr;
-
-  Config config;
+  Config config = makeConfig();
   if (argc == 5) {
     config.pC = atof(argv[2]);
     config.pL = atof(argv[3]);
@@ -93,95 +273,182 @@ int main(int argc, char *argv[])
     config.timeout_sec = 0;
     config.timeout_usec = 5000;
   }
+  config.pacingRate = pacingRate;
+  config.txTime = txTime;
+  config.dupAckThreshold = dupAckThreshold;
 
   //printf("WindowSize: %d\n", config.windowSize);
-  Buffer rec;
-  rec.data = NULL;
-  rec.length = 0;
-
-  // Will keep timing out while waiting for client to connect, so this will
-  // keep waiting for a client to connect before continuing
-  while (0 == rec.length) {
-    rec = receiveBytes(sockfd, (struct sockaddr *)&their_addr, &addr_len, config);
-  }
-
-  // Ensure string
-  rec.data = (uint8_t *)realloc(rec.data, rec.length + 1 * sizeof(uint8_t));
-  rec.length++;
-  rec.data[rec.length-1] = '\0';
-
-  printf("Received %zu bytes\n", rec.length);
-  printf("Client asked for file: %s\n", rec.data);
-
-  // Open the requested file
-  FILE *fp = fopen((const char *)rec.data, "r");
 
-  // Default buffer to zero length
-  // Send zero bytes in case of error
-  Buffer fileBuffer;
-  fileBuffer.length = 0;
-  fileBuffer.data = 0;
+  // Every transfer runs over the listening socket, driven from this loop
+  int flags = fcntl(sockfd, F_GETFL, 0);
+  fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+  config.txTime = config.txTime && enableTxTime(sockfd);
 
-  if (fp == NULL) {
-    printf("Error: File %s cannot be found\n", rec.data);
+  // Epochs of recently served requests, so that a client resending its
+  // request before the answer reaches it is not served twice
+  uint32_t recentEpochs[RECENT_EPOCHS];
+  memset(recentEpochs, 0, sizeof(recentEpochs));
+  int nextRecent = 0;
 
-    sendBytes(fileBuffer, sockfd, (struct sockaddr*)&their_addr, addr_len, config);
-
-    exit(1);
-  }
+  uint8_t buffer[MAX_PACKET_SIZE];
 
-  char * fileBuf;
-  long fileSize;
-  size_t fileLength;
+  // When the scheduler next has something to send
+  uint64_t sendDue = UINT64_MAX;
 
-  // Load opened file into fileBuf
-  if (!fseek(fp, 0L, SEEK_END)) { // Set stream position to end of file (SEEK_END)
+  // Whether the cache has files still to read in
+  bool loading = false;
 
-    fileSize = ftell(fp);
+  int numTransfers = 0;
 
-    // Ensure valid size
-    if (fileSize == -1) {
-      printf("Error: File %s cannot be found\n", rec.data);
-
-      sendBytes(fileBuffer, sockfd, (struct sockaddr*)&their_addr, addr_len, config);
-
-      exit(1);
+  while (1) {
+    // Sleep until a packet arrives or the earliest timer is due
+    uint64_t now = monotonicNanos();
+    uint64_t deadline = loading ? now : sendDue;
+    for (int i = 0; i < TRANSFER_BUCKETS; i++) {
+      for (Transfer *t = transfers[i]; t; t = t->chain) {
+        uint64_t due = connectionDeadline(t->conn);
+        deadline = due < deadline ? due : deadline;
+      }
     }
-
-    fileBuf = (char *)malloc(sizeof(char) * (fileSize+1));
-
-    // Reset position to beginning
-    if (fseek(fp, 0L, SEEK_SET)) {
-      printf("Error: File seeking cannot be completed for %s\n", rec.data);
-
-      sendBytes(fileBuffer, sockfd, (struct sockaddr*)&their_addr, addr_len, config);
-
-      exit(1);
+    struct timeval tv;
+    tv.tv_sec = IDLE_WAIT_SEC;
+    tv.tv_usec = 0;
+    if (deadline != UINT64_MAX) {
+      uint64_t wait = deadline > now ? deadline - now : 0;
+      tv.tv_sec = wait / 1000000000ULL;
+      tv.tv_usec = (wait % 1000000000ULL) / 1000;
     }
 
-    fileLength = fread(fileBuf, sizeof(char), fileSize, fp);
-
-    printf("fileLength: %zu\n", fileLength);
-
-    // Ensure non-zero length output
-    if (!fileLength) {
-      printf("Error: Cannot read file %s\n", rec.data);
-
-      sendBytes(fileBuffer, sockfd, (struct sockaddr*)&their_addr, addr_len, config);
-
-      exit(1);
+    // Take in every packet that is waiting
+    ssize_t bytesRec;
+    addr_len = sizeof their_addr;
+    while (-1 != (bytesRec = receiveDatagram(sockfd, buffer,
+                                             (struct sockaddr *)&their_addr,
+                                             &addr_len, config, tv))) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+      now = monotonicNanos();
+
+      Packet rec;
+      if (0 == bytesRec || !parseHeader(buffer, bytesRec, &rec)) {
+        addr_len = sizeof their_addr;
+        continue;
+      }
+
+      Transfer *transfer = findTransfer(rec.epoch);
+      if (transfer) {
+        if (sameAddress((struct sockaddr *)&their_addr,
+                        (struct sockaddr *)&transfer->addr)) {
+          connectionInput(transfer->conn, buffer, bytesRec, now);
+        }
+        addr_len = sizeof their_addr;
+        continue;
+      }
+
+      // Anything but a new REQ is left over from a finished transfer
+      bool duplicate = !rec.isReq || 0 == rec.length;
+      for (int i = 0; i < RECENT_EPOCHS; i++) {
+        duplicate = duplicate || recentEpochs[i] == rec.epoch;
+      }
+      if (duplicate) {
+        addr_len = sizeof their_addr;
+        continue;
+      }
+
+      // Without memory for the transfer, drop the request; the client will
+      // send it again
+      transfer = (Transfer *)malloc(sizeof(Transfer));
+      if (!transfer) {
+        printf("Error: Cannot allocate a transfer for epoch %u\n", rec.epoch);
+        addr_len = sizeof their_addr;
+        continue;
+      }
+
+      recentEpochs[nextRecent] = rec.epoch;
+      nextRecent = (nextRecent + 1) % RECENT_EPOCHS;
+
+      printf("Received %zu bytes\n", rec.length);
+
+      Buffer req;
+      req.data = rec.data;
+      req.length = rec.length;
+      Request request;
+      bool valid = parseRequest(req, &request);
+
+      CacheEntry *entry = NULL;
+      if (valid && (request.type == REQUEST_FILE ||
+                    request.type == REQUEST_RANGE)) {
+        entry = cacheAcquire(request.path);
+      }
+
+      // Profile from the first transfer after an idle spell to the last
+      if (0 == numTransfers++) {
+        profileReset();
+      }
+
+      transfer->conn = makeServerConnection(rec.epoch, config, now);
+      memcpy(&transfer->addr, &their_addr, addr_len);
+      transfer->addrLen = addr_len;
+      transfer->producer = NULL;
+      schedulerAdd(&transfer->turn, transfer->conn,
+                   (struct sockaddr *)&transfer->addr, transfer->addrLen, now);
+      transfer->chain = transfers[rec.epoch % TRANSFER_BUCKETS];
+      transfers[rec.epoch % TRANSFER_BUCKETS] = transfer;
+
+      uint64_t started = profileStart();
+      serveRequest(valid ? &request : NULL, entry, transfer);
+      profileEnd(PHASE_PRODUCE, started);
+      if (!transfer->producer) {
+        connectionFinish(transfer->conn);
+      }
+      addr_len = sizeof their_addr;
     }
 
-    fileBuf[fileLength] = '\0';
+    // Read some more of the files being loaded into the cache
+    uint64_t fillStarted = profileStart();
+    loading = cacheFill(CACHE_FILL_BYTES);
+    profileEnd(PHASE_PRODUCE, fillStarted);
+
+    // Run timers and produce what is queued
+    now = monotonicNanos();
+    for (int i = 0; i < TRANSFER_BUCKETS; i++) {
+      for (Transfer *t = transfers[i]; t; t = t->chain) {
+        uint64_t started = profileStart();
+        if (t->producer && producerFill(t->producer)) {
+          freeProducer(t->producer);
+          t->producer = NULL;
+        }
+        profileEnd(PHASE_PRODUCE, started);
+        if (connectionDeadline(t->conn) <= now) {
+          connectionTick(t->conn, now);
+        }
+      }
+    }
 
-    Buffer fileBuffer;
-    fileBuffer.data = (uint8_t *)fileBuf;
-    fileBuffer.length = fileLength;
-    sendBytes(fileBuffer, sockfd, (struct sockaddr *)&their_addr, addr_len, config);
+    // Send a batch, with the transfers taking turns
+    sendDue = schedulerRun(sockfd, now);
+
+    // Retire finished transfers
+    for (int i = 0; i < TRANSFER_BUCKETS; i++) {
+      Transfer **link = &transfers[i];
+      while (*link) {
+        Transfer *t = *link;
+        if (connectionState(t->conn) != CONNECTION_OPEN) {
+          *link = t->chain;
+          schedulerRemove(&t->turn);
+          freeProducer(t->producer);
+          freeConnection(t->conn);
+          free(t);
+          if (0 == --numTransfers && profilePath) {
+            reportProfile(profilePath);
+          }
+        } else {
+          link = &t->chain;
+        }
+      }
+    }
   }
 
-  fclose(fp);
-
   close(sockfd);
 
   return 0;
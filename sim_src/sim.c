@@ -0,0 +1,461 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/connection.h"
+#include "../lib/rdtp.h"
+
+/**
+ * Discrete-event simulator for RDTP.  A client and a server Connection talk
+ * over a modelled link in virtual time: nothing sleeps and no socket is
+ * opened, so a transfer that would take minutes runs in a fraction of a
+ * second.  Every random choice comes from a seeded generator, so a run with
+ * the same parameters gives the same result every time.
+ *
+ * Each direction of the link has a bandwidth, a one-way delay, a drop-tail
+ * queue and a random loss rate.
+ */
+
+// Length of a comma separated parameter list
+#define MAX_SWEEP 64
+
+// Most events pending at once; each is a datagram in flight or a timer
+#define INITIAL_EVENTS 1024
+
+typedef struct Link {
+  double bandwidth;    // bytes/sec
+  uint64_t delay;      // one-way propagation delay in ns
+  size_t queueBytes;   // bytes the bottleneck queue holds
+  double loss;         // chance of losing a datagram
+  uint64_t busyUntil;  // when the last queued datagram is fully sent
+  long sent;
+  long lost;
+  long dropped;        // queue overflows
+} Link;
+
+typedef enum { EVENT_DELIVER, EVENT_TIMER } EventType;
+
+typedef struct Event {
+  uint64_t time;
+  uint64_t order;      // breaks ties in scheduling order
+  EventType type;
+  int endpoint;        // 0 is the client, 1 the server
+  uint8_t *data;       // datagram to deliver
+  size_t length;
+} Event;
+
+typedef struct Endpoint {
+  Connection *conn;
+  Link *out;           // link the endpoint sends on
+  uint64_t timerAt;    // time of the pending timer event, UINT64_MAX if none
+} Endpoint;
+
+typedef struct Sim {
+  Event *heap;
+  int numEvents;
+  int capacity;
+  uint64_t nextOrder;
+  uint64_t now;
+  uint64_t rng;
+  Endpoint endpoints[2];
+  Link links[2];       // client to server, server to client
+  Config config;
+  const uint8_t *stream;
+  size_t streamLength;
+  size_t received;
+  long dataPackets;    // TRN packets the server sent
+  long events;
+} Sim;
+
+/**
+ * xorshift64*, so runs do not depend on the C library's rand
+ */
+static double nextRandom(Sim *sim) {
+  sim->rng ^= sim->rng >> 12;
+  sim->rng ^= sim->rng << 25;
+  sim->rng ^= sim->rng >> 27;
+  return (double)((sim->rng * 0x2545F4914F6CDD1DULL) >> 11) /
+         (double)(1ULL << 53);
+}
+
+static bool before(const Event *a, const Event *b) {
+  return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void pushEvent(Sim *sim, Event event) {
+  if (sim->numEvents == sim->capacity) {
+    sim->capacity *= 2;
+    sim->heap = (Event *)realloc(sim->heap, sim->capacity * sizeof(Event));
+    assert(sim->heap);
+  }
+  event.order = sim->nextOrder++;
+
+  int i = sim->numEvents++;
+  while (i && before(&event, &sim->heap[(i - 1) / 2])) {
+    sim->heap[i] = sim->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  sim->heap[i] = event;
+}
+
+static Event popEvent(Sim *sim) {
+  Event top = sim->heap[0];
+  Event last = sim->heap[--sim->numEvents];
+
+  int i = 0;
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= sim->numEvents) {
+      break;
+    }
+    if (child + 1 < sim->numEvents &&
+        before(&sim->heap[child + 1], &sim->heap[child])) {
+      child++;
+    }
+    if (!before(&sim->heap[child], &last)) {
+      break;
+    }
+    sim->heap[i] = sim->heap[child];
+    i = child;
+  }
+  sim->heap[i] = last;
+  return top;
+}
+
+/**
+ * Put a datagram on a link, to arrive at the other endpoint later
+ */
+static void transmit(Sim *sim, int from, const Datagram *datagram) {
+  Link *link = sim->endpoints[from].out;
+  size_t length = 0;
+  for (int i = 0; i < datagram->iovlen; i++) {
+    length += datagram->iov[i].iov_len;
+  }
+  link->sent++;
+
+  // Drop the datagram if the queue ahead of it is full
+  uint64_t departure = sim->now > datagram->txTime ? sim->now
+                                                    : datagram->txTime;
+  uint64_t backlog = link->busyUntil > departure
+                         ? link->busyUntil - departure
+                         : 0;
+  if (link->queueBytes < backlog * link->bandwidth / 1e9) {
+    link->dropped++;
+    return;
+  }
+  if (departure < link->busyUntil) {
+    departure = link->busyUntil;
+  }
+  link->busyUntil = departure + (uint64_t)(length * 1e9 / link->bandwidth);
+
+  if (nextRandom(sim) < link->loss) {
+    link->lost++;
+    return;
+  }
+
+  Event event;
+  event.time = link->busyUntil + link->delay;
+  event.type = EVENT_DELIVER;
+  event.endpoint = 1 - from;
+  event.length = length;
+  event.data = (uint8_t *)malloc(length);
+  assert(event.data);
+  size_t done = 0;
+  for (int i = 0; i < datagram->iovlen; i++) {
+    memcpy(event.data + done, datagram->iov[i].iov_base,
+           datagram->iov[i].iov_len);
+    done += datagram->iov[i].iov_len;
+  }
+  pushEvent(sim, event);
+}
+
+/**
+ * Let an endpoint run its timers, send what it has, and read what it got,
+ * then schedule its next timer
+ */
+static void service(Sim *sim, int index) {
+  Endpoint *endpoint = &sim->endpoints[index];
+  Connection *conn = endpoint->conn;
+  if (!conn) {
+    return;
+  }
+
+  if (connectionDeadline(conn) <= sim->now) {
+    connectionTick(conn, sim->now);
+  }
+
+  Datagram datagram;
+  while (connectionOutput(conn, sim->now, &datagram)) {
+    Packet sent;
+    if (index == 1 &&
+        parseHeader((const uint8_t *)datagram.iov[0].iov_base,
+                    datagram.iov[0].iov_len, &sent) &&
+        !sent.isAck && !sent.isFin && !sent.isReq) {
+      sim->dataPackets++;
+    }
+    transmit(sim, index, &datagram);
+  }
+
+  uint8_t chunk[16 * 1024];
+  size_t length;
+  while ((length = connectionRead(conn, chunk, sizeof(chunk)))) {
+    sim->received += length;
+  }
+
+  uint64_t deadline = connectionDeadline(conn);
+  if (deadline != UINT64_MAX && deadline != endpoint->timerAt) {
+    endpoint->timerAt = deadline;
+    Event event;
+    event.time = deadline > sim->now ? deadline : sim->now;
+    event.type = EVENT_TIMER;
+    event.endpoint = index;
+    event.data = NULL;
+    event.length = 0;
+    pushEvent(sim, event);
+  }
+}
+
+/**
+ * Start the server's connection on the first request, and queue the stream
+ */
+static void acceptRequest(Sim *sim, const Event *event) {
+  Packet rec;
+  if (!parseHeader(event->data, event->length, &rec) || !rec.isReq) {
+    return;
+  }
+
+  Connection *conn = makeServerConnection(rec.epoch, sim->config, sim->now);
+  connectionSendBuffer(conn, sim->stream, sim->streamLength, NULL, NULL);
+  connectionFinish(conn);
+  sim->endpoints[1].conn = conn;
+}
+
+typedef struct Result {
+  ConnectionState state;
+  uint64_t duration;   // virtual ns until the client was done
+  double wallSeconds;
+} Result;
+
+/**
+ * Run one transfer of the stream to completion, or until limit ns of
+ * virtual time have passed
+ */
+static Result runTransfer(Sim *sim, uint64_t limit) {
+  Result result;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  Buffer request;
+  request.data = (uint8_t *)"sim";
+  request.length = 3;
+  sim->endpoints[0].conn = makeClientConnection(request, sim->config, 0);
+  service(sim, 0);
+
+  Connection *client = sim->endpoints[0].conn;
+  while (sim->numEvents && connectionState(client) == CONNECTION_OPEN &&
+         sim->heap[0].time <= limit) {
+    Event event = popEvent(sim);
+    sim->now = event.time;
+    sim->events++;
+
+    Endpoint *endpoint = &sim->endpoints[event.endpoint];
+    if (event.type == EVENT_TIMER) {
+      // A later timer replaced this one
+      if (event.time != endpoint->timerAt) {
+        continue;
+      }
+      endpoint->timerAt = UINT64_MAX;
+    } else {
+      if (!endpoint->conn && event.endpoint == 1) {
+        acceptRequest(sim, &event);
+      }
+      if (endpoint->conn) {
+        connectionInput(endpoint->conn, event.data, event.length, sim->now);
+      }
+      free(event.data);
+    }
+    service(sim, event.endpoint);
+  }
+
+  result.state = connectionState(client);
+  result.duration = sim->now;
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result.wallSeconds = (end.tv_sec - start.tv_sec) +
+                       (end.tv_nsec - start.tv_nsec) / 1e9;
+  return result;
+}
+
+static void freeSim(Sim *sim) {
+  while (sim->numEvents) {
+    Event event = popEvent(sim);
+    free(event.data);
+  }
+  free(sim->heap);
+  freeConnection(sim->endpoints[0].conn);
+  freeConnection(sim->endpoints[1].conn);
+}
+
+/**
+ * Parse a comma separated list of numbers.  Returns how many there were.
+ */
+static int parseList(const char *arg, double *values) {
+  int count = 0;
+  char *end;
+  while (count < MAX_SWEEP) {
+    values[count++] = strtod(arg, &end);
+    if (*end != ',') {
+      break;
+    }
+    arg = end + 1;
+  }
+  return count;
+}
+
+int main(int argc, char *argv[])
+{
+  double bandwidthMbit = 100;
+  double delayMs = 10;
+  double queueKB = 64;
+  double megabytes = 10;
+  double limitSec = 3600;
+  uint64_t seed = 1;
+  Config config = makeConfig();
+
+  double windows[MAX_SWEEP] = { config.windowSize };
+  int numWindows = 1;
+  double timeouts[MAX_SWEEP] = { config.timeout_usec };
+  int numTimeouts = 1;
+  double losses[MAX_SWEEP] = { 0 };
+  int numLosses = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:d:l:q:n:w:t:p:D:s:L:")) != -1) {
+    switch (opt) {
+      case 'b':
+        bandwidthMbit = atof(optarg);
+        break;
+      case 'd':
+        delayMs = atof(optarg);
+        break;
+      case 'l':
+        numLosses = parseList(optarg, losses);
+        break;
+      case 'q':
+        queueKB = atof(optarg);
+        break;
+      case 'n':
+        megabytes = atof(optarg);
+        break;
+      case 'w':
+        numWindows = parseList(optarg, windows);
+        break;
+      case 't':
+        numTimeouts = parseList(optarg, timeouts);
+        break;
+      case 'p':
+        config.pacingRate = atof(optarg);
+        break;
+      case 'D':
+        config.dupAckThreshold = atoi(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'L':
+        limitSec = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: sim [-b <Mbit/s>] [-d <one-way delay ms>] [-l <loss>[,...]] [-q <queue KB>] [-n <MB>] [-w <window>[,...]] [-t <timeout usec>[,...]] [-p <pacing bytes/sec>] [-D <dup ACKs>] [-s <seed>] [-L <virtual sec limit>]\n");
+        exit(1);
+    }
+  }
+
+  // The stream content does not matter, only that the hash can check it
+  size_t streamLength = megabytes * 1024 * 1024;
+  uint8_t *stream = (uint8_t *)malloc(streamLength ? streamLength : 1);
+  assert(stream);
+  uint64_t fill = seed;
+  for (size_t i = 0; i < streamLength; i++) {
+    fill = fill * 6364136223846793005ULL + 1442695040888963407ULL;
+    stream[i] = fill >> 56;
+  }
+
+  printf("%8s %10s %8s %10s %10s %10s %9s %8s %8s %10s %8s\n", "window",
+         "timeout_us", "loss", "result", "virtual_s", "Mbit/s", "data_pkts",
+         "retx", "drops", "events", "wall_s");
+
+  int failures = 0;
+  for (int w = 0; w < numWindows; w++) {
+    for (int t = 0; t < numTimeouts; t++) {
+      for (int l = 0; l < numLosses; l++) {
+        Sim sim;
+        memset(&sim, 0, sizeof(sim));
+        sim.capacity = INITIAL_EVENTS;
+        sim.heap = (Event *)malloc(sim.capacity * sizeof(Event));
+        assert(sim.heap);
+        sim.rng = seed ? seed : 1;
+        sim.stream = stream;
+        sim.streamLength = streamLength;
+
+        sim.config = config;
+        sim.config.windowSize = windows[w];
+        sim.config.timeout_sec = timeouts[t] / 1000000;
+        sim.config.timeout_usec = (long)timeouts[t] % 1000000;
+
+        for (int i = 0; i < 2; i++) {
+          sim.links[i].bandwidth = bandwidthMbit * 1e6 / 8;
+          sim.links[i].delay = delayMs * 1e6;
+          sim.links[i].queueBytes = queueKB * 1024;
+          sim.links[i].loss = losses[l];
+          sim.endpoints[i].out = &sim.links[i];
+          sim.endpoints[i].timerAt = UINT64_MAX;
+        }
+
+        // Report the window the connections actually use
+        int window = sim.config.windowSize;
+        if (window > maxWindowSize()) {
+          window = maxWindowSize();
+          fprintf(stderr, "Note: window %d is cut down to %d\n",
+                  sim.config.windowSize, window);
+        }
+
+        Result result = runTransfer(&sim, limitSec * 1e9);
+        const char *outcome = "done";
+        if (result.state == CONNECTION_OPEN) {
+          outcome = "timeout";
+        } else if (result.state == CONNECTION_FAILED) {
+          outcome = "failed";
+        } else if (result.state == CONNECTION_CORRUPTED) {
+          outcome = "corrupt";
+        } else if (sim.received != streamLength) {
+          outcome = "short";
+        }
+        failures += 0 != strcmp(outcome, "done");
+
+        long needed = (streamLength + MAX_PACKET_SIZE - PACKET_HEADER_LENGTH -
+                       1) / (MAX_PACKET_SIZE - PACKET_HEADER_LENGTH);
+        double seconds = result.duration / 1e9;
+        printf("%8d %10.0f %8.4f %10s %10.3f %10.2f %9ld %8ld %8ld %10ld "
+               "%8.3f\n",
+               window, timeouts[t], sim.links[0].loss,
+               outcome, seconds,
+               seconds ? sim.received * 8 / seconds / 1e6 : 0,
+               sim.dataPackets, sim.dataPackets - needed,
+               sim.links[0].dropped + sim.links[1].dropped, sim.events,
+               result.wallSeconds);
+        fflush(stdout);
+
+        freeSim(&sim);
+      }
+    }
+  }
+
+  free(stream);
+  return failures ? 1 : 0;
+}